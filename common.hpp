@@ -71,10 +71,34 @@ int roman_to_int(std::string s) {
 };
 
 std::string int_to_roman(int num) {
-  check(num >= 1 && num <= 17, "invalid number");
+  check(num >= 1 && num <= 16, "invalid number");
   return romans[num - 1];
 };
 
+// markets past the 16 romans get letter suffixes whose first letter is never a roman digit, so they cannot collide
+std::string int_to_lpsuffix(uint32_t num, size_t max_len) {
+  if (num <= 16) return int_to_roman(num);
+
+  const std::string heads = "ABCDEFGHJKLMNOPQRSTUWYZ";
+  uint64_t k = num - 17;
+  uint64_t span = heads.size();
+  size_t len = 1;
+  while (k >= span) {
+    k -= span;
+    span *= 26;
+    len++;
+  }
+  check(len <= max_len, "lp symbol space exhausted");
+
+  std::string s(len, 'A');
+  for (size_t i = len - 1; i > 0; i--) {
+    s[i] = 'A' + k % 26;
+    k /= 26;
+  }
+  s[0] = heads[k];
+  return s;
+};
+
 uint32_t current_secs() {
   time_point tp = current_time_point();
   return tp.sec_since_epoch();
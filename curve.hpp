@@ -0,0 +1,403 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <stddef.h>
+
+// CURVE_SCALAR forces the scalar batch path on native builds, the one wasm always takes
+#if !defined(CURVE_SCALAR) && (defined(__AVX__) || defined(__SSE2__))
+#define CURVE_SIMD
+#include <immintrin.h>
+#endif
+
+// invariant math shared by the contract and off-chain tools, it must not depend on eosio
+namespace pizzair {
+  inline double cal_D(double A, double x, double y) {
+    double n = 4*(4*A - 1)*x*y;
+    double m = -16*A*x*y*(x+y);
+    double t = sqrt(pow(m/2, 2)+pow(n/3, 3));
+    return cbrt(-m/2 + t) + cbrt(-m/2 - t);
+  };
+
+  // p_to_q with D already known, D only depends on the market so batch callers compute it once
+  inline double p_to_q_by_D(double p, double A, double x, double y, double D) {
+    double G = 4*A*(x+y+p-D) + D;
+    double c = 4*y*G - pow(D, 3)/(x+p);
+    double a = 16*A;
+    double b = -(4*G + 16*A*y);
+    double delta = pow(b, 2) - 4*a*c;
+    double q = (-b - sqrt(delta)) / (2*a);
+    return q;
+  };
+
+  inline double p_to_q(double p, double A, double x, double y) {
+    return p_to_q_by_D(p, A, x, y, cal_D(A, x, y));
+  };
+
+  inline double cal_price(double A, double x, double y) {
+    double p = std::min(x, y) * pow(10, -6);
+    return p_to_q(p, A, x, y) / p;
+  };
+
+  // -dy/dx on the invariant at (x, y). cal_price differences p_to_q over a small step, which loses
+  // every digit once the short side is far below the rounding of the long one, this does not
+  inline double marginal_price(double A, double x, double y) {
+    double D3 = pow(cal_D(A, x, y), 3);
+    return (4*A + D3 / (4*x*x*y)) / (4*A + D3 / (4*x*y*y));
+  };
+
+  // inverse of p_to_q: solves the invariant for the input side once y has dropped by q
+  inline double q_to_p(double q, double A, double x, double y) {
+    double D = cal_D(A, x, y);
+    double z = y - q;
+    double a = 16*A*z;
+    double b = 4*z*(4*A*z + D - 4*A*D);
+    double delta = pow(b, 2) + 4*a*pow(D, 3);
+    double w = (-b + sqrt(delta)) / (2*a);
+    return w - x;
+  };
+
+  // clear_price when the x side is the net seller: the pool takes dx = X - Y/P along the curve
+  // and pays p_to_q(dx), which must equal X*P - Y, somewhere between Y/X and the marginal price
+  inline double clear_price_net(double A, double x, double y, double X, double Y, double marginal) {
+    if (Y <= 0) return p_to_q(X, A, x, y) / X;
+
+    double lo = Y / X;
+    double hi = marginal;
+    for (int i = 0; i < 64; i++) {
+      double P = (lo + hi) / 2;
+      if (X*P - Y < p_to_q(X - Y/P, A, x, y)) {
+        lo = P;
+      } else {
+        hi = P;
+      }
+    }
+    return lo;
+  };
+
+  // uniform price (y per x) at which X sold of x and Y sold of y clear against each other and the pool
+  inline double clear_price(double A, double x, double y, double X, double Y) {
+    double marginal = marginal_price(A, x, y);
+    if (X*marginal > Y) return clear_price_net(A, x, y, X, Y, marginal);
+    if (X*marginal < Y) return 1 / clear_price_net(A, y, x, Y, X, 1 / marginal);
+    return marginal;
+  };
+
+  // smallest amount that is still worth net after the fee truncation done in _swap
+  inline int64_t amount_before_fee(int64_t net, double fee_rate) {
+    int64_t amount = ceil(net / (1 - fee_rate));
+    while (amount - (int64_t)((double)amount * fee_rate) < net) amount++;
+    while (amount > net && (amount - 1) - (int64_t)((double)(amount - 1) * fee_rate) >= net) amount--;
+    return amount;
+  };
+
+  inline double cal_pzprice(double pzprice, double pzprice_rate, uint64_t updated_at, uint64_t now) {
+    uint64_t secs = (now - updated_at) / 1000;
+    return pzprice * (1 + pzprice_rate * secs);
+  };
+
+  inline int64_t pz_to_anchor(int64_t pzamount, uint8_t pz_precision, uint8_t precision, double pzprice) {
+    return (double)pzamount / pow(10, pz_precision) * pow(10, precision) * pzprice;
+  };
+
+  inline int64_t anchor_to_pz(int64_t amount, uint8_t precision, uint8_t pz_precision, double pzprice) {
+    return (double)amount / pow(10, precision) * pow(10, pz_precision) / pzprice;
+  };
+
+  struct swap_quote {
+    int64_t got;
+    int64_t fee;
+    int64_t admin_fee;
+    int64_t invite_fee;
+  };
+
+  // the arithmetic of an exact-input _swap on anchor-denominated reserves x (in side) and y (out side)
+  inline swap_quote quote_swap(int64_t amount, double A, double x, double y, uint8_t in_precision, uint8_t out_precision,
+                               double fee_rate, double lp_rate, bool fee_on_in, double invite_fee_rate = 0) {
+    swap_quote r = {0, 0, 0, 0};
+    int64_t from = amount;
+    if (fee_on_in) {
+      r.fee = (double)from * fee_rate;
+      r.invite_fee = (double)from * invite_fee_rate;
+      from -= r.fee;
+    }
+
+    double q = p_to_q((double)from / pow(10, in_precision), A, x, y);
+    r.got = q * pow(10, out_precision);
+
+    if (!fee_on_in) {
+      r.fee = (double)r.got * fee_rate;
+      r.invite_fee = (double)r.got * invite_fee_rate;
+      r.got -= r.fee;
+    }
+
+    r.admin_fee = (double)r.fee * (1 - lp_rate);
+    r.invite_fee = std::min(r.invite_fee, r.admin_fee);
+    r.admin_fee -= r.invite_fee;
+    return r;
+  };
+
+  // asset::max_amount
+  static constexpr int64_t MAX_AMOUNT = (1LL << 62) - 1;
+
+  // smallest amount an exact-input _swap turns into at least `out`, checked against quote_swap in
+  // both directions. -1 when the reserve cannot pay `out`, 0 when no amount was found
+  inline int64_t exact_in(int64_t out, double A, double x, double y, uint8_t in_precision, uint8_t out_precision,
+                          double fee_rate, bool fee_on_in) {
+    double in_unit = pow(10, in_precision);
+    double out_unit = pow(10, out_precision);
+
+    int64_t gross_out = fee_on_in ? out : amount_before_fee(out, fee_rate);
+    double q = gross_out / out_unit;
+    if (q >= y) return -1;
+
+    double p = q_to_p(q, A, x, y);
+    if (!(p >= 0)) return 0;
+    int64_t net_in = ceil(p * in_unit);
+    int64_t amount = fee_on_in ? amount_before_fee(net_in, fee_rate) : net_in;
+
+    auto got = [&](int64_t a) {
+      return quote_swap(a, A, x, y, in_precision, out_precision, fee_rate, 0, fee_on_in).got;
+    };
+    // bracket the boundary as got(lo) < out <= got(hi), galloping because one unit is below double
+    // resolution on large amounts, then bisect. when the estimate is right this is two quotes
+    int64_t lo = amount - 1, hi = amount;
+    int64_t step = 1;
+    while (got(hi) < out) {
+      if (hi > MAX_AMOUNT - step) return 0;
+      lo = hi;
+      hi += step;
+      step *= 2;
+    }
+    step = 1;
+    while (lo > 0 && got(lo) >= out) {
+      hi = lo;
+      lo = std::max<int64_t>(lo - step, 0);
+      step *= 2;
+    }
+    while (hi - lo > 1) {
+      int64_t mid = lo + (hi - lo) / 2;
+      if (got(mid) >= out) {
+        hi = mid;
+      } else {
+        lo = mid;
+      }
+    }
+    return hi;
+  };
+
+  // leverage passed_secs into a ramp from `from` to `to`
+  inline uint32_t ramp_leverage(uint32_t from, uint32_t to, uint32_t passed_secs, uint32_t effective_secs) {
+    if (passed_secs >= effective_secs) return to;
+
+    int64_t diff = (int64_t)to - (int64_t)from;
+    return from + diff * passed_secs / effective_secs;
+  };
+
+  // part of a reserve paid for lpshare of lpamount lp tokens
+  inline int64_t withdraw_share(int64_t reserve, int64_t lpshare, int64_t lpamount) {
+    double ratio = (double)lpshare / lpamount;
+    return reserve * ratio;
+  };
+
+  enum supply_error : uint8_t {
+    SUPPLY_OK = 0,
+    SUPPLY_FIRST_UNEQUAL = 1,   // first supply with different amounts
+    SUPPLY_DISPROPORTION = 2,   // the extra side is larger than the pool holds of it
+    SUPPLY_UNSOLVED = 3,        // the bisection found no price in 10 rounds
+  };
+
+  struct supply_quote {
+    int64_t lpamount;
+    int extra_index;   // side deposited beyond the pool ratio, -1 when none
+    int64_t dropped;   // dust of the extra side left out of the deposit
+    uint8_t error;
+  };
+
+  // the arithmetic of _supply on anchor-denominated reserves. the part of the deposits in the pool
+  // ratio gets its share of lpamount, the extra side is valued as if part p of it was swapped along
+  // the curve at a price found by bisection, so that what is left and what p bought are in ratio
+  inline supply_quote quote_supply(const int64_t deposits[2], const int64_t reserves[2], const uint8_t precisions[2],
+                                   int64_t lpamount, uint8_t lp_precision, double A) {
+    supply_quote r = {0, -1, 0, SUPPLY_OK};
+    double units[2] = {pow(10, precisions[0]), pow(10, precisions[1])};
+    double deposit_rs[2] = {deposits[0] / units[0], deposits[1] / units[1]};
+    double raw_rs[2] = {reserves[0] / units[0], reserves[1] / units[1]};
+
+    double raw_ratio = 1;
+    if (raw_rs[1] > 0) {
+      raw_ratio = raw_rs[0] / raw_rs[1];
+    }
+
+    double extra_rs = 0;
+    double standard_deposit_rs[2] = {deposit_rs[0], deposit_rs[1]};
+    if (deposit_rs[1] == 0) {
+      r.extra_index = 0;
+      extra_rs = deposit_rs[0];
+      standard_deposit_rs[0] = 0;
+    } else if (deposit_rs[0] == 0) {
+      r.extra_index = 1;
+      extra_rs = deposit_rs[1];
+      standard_deposit_rs[1] = 0;
+    } else {
+      double deposit_ratio = deposit_rs[0] / deposit_rs[1];
+      if (deposit_ratio > raw_ratio) {
+        r.extra_index = 0;
+        extra_rs = deposit_rs[1] * (deposit_ratio - raw_ratio);
+        standard_deposit_rs[0] -= extra_rs;
+      } else if (deposit_ratio < raw_ratio) {
+        r.extra_index = 1;
+        extra_rs = deposit_rs[0] * (1/deposit_ratio - 1/raw_ratio);
+        standard_deposit_rs[1] -= extra_rs;
+      }
+    }
+
+    int64_t standard_lpamount = 0;
+    if (lpamount == 0) {
+      if (standard_deposit_rs[0] != standard_deposit_rs[1]) {
+        r.error = SUPPLY_FIRST_UNEQUAL;
+        return r;
+      }
+      standard_lpamount = standard_deposit_rs[0] * pow(10, lp_precision) * 2;
+    } else {
+      standard_lpamount = standard_deposit_rs[0] / raw_rs[0] * lpamount;
+    }
+
+    int64_t extra_lpamount = 0;
+    int64_t extra_amount = 0;
+    if (r.extra_index >= 0) {
+      extra_amount = extra_rs * units[r.extra_index];
+    }
+
+    if (r.extra_index < 0) {
+      // deposits already in the pool proportion
+    } else if (extra_rs <= 0.0001) {
+      r.dropped = extra_amount;
+    } else if (extra_amount > 1) {
+      int other_index = r.extra_index == 0 ? 1 : 0;
+
+      double latest_rs[2] = {raw_rs[0] + standard_deposit_rs[0], raw_rs[1] + standard_deposit_rs[1]};
+      if (extra_rs > latest_rs[r.extra_index]) {
+        r.error = SUPPLY_DISPROPORTION;
+        return r;
+      }
+      double x = latest_rs[r.extra_index];
+      double y = latest_rs[other_index];
+      double n = extra_rs;
+
+      double max_price = cal_price(A, x, y);
+      double min_price = cal_price(A, x + n, y);
+
+      int times = 0;
+      double price, p, q;
+      while (true) {
+        if (++times > 10) {
+          r.error = SUPPLY_UNSOLVED;
+          return r;
+        }
+        price = (max_price + min_price) / 2;
+        p = y * n / ((x + n) * price + y);
+        q = p_to_q(p, A, x, y);
+        double verify = q * (x + p) / ((n - p) * (y - q)) - 1;
+        if (verify >= 0.0005) {
+          min_price = price;
+        } else if (verify < 0) {
+          max_price = price;
+        } else {
+          break;
+        }
+      }
+      extra_lpamount = (n - p) / (x + p) * (lpamount + standard_lpamount);
+    }
+
+    r.lpamount = standard_lpamount + extra_lpamount;
+    return r;
+  };
+
+  // batch forms: D and every other per-market term are computed once, the per-amount part runs
+  // through _p_to_q_lanes, which uses AVX or SSE2 when the target has them and plain scalar code
+  // otherwise (wasm included). the vector lanes evaluate the same operations in the same order as
+  // p_to_q_by_D, only sqrt, mul, add, sub and div, all correctly rounded, so results are bit-identical
+  // to the scalar calls. native builds need -ffp-contract=off for that, wasm never fuses multiply-adds
+  struct p_to_q_terms {
+    double A4, xy, x, D, y4, D3, A16y, a4, a2;
+
+    p_to_q_terms(double A, double x, double y, double D) :
+      A4(4*A), xy(x+y), x(x), D(D), y4(4*y), D3(pow(D, 3)), A16y(16*A*y), a4(4*(16*A)), a2(2*(16*A)) {}
+  };
+
+  inline void _p_to_q_lanes(const double* __restrict ps, double* __restrict qs, size_t n, const p_to_q_terms& t) {
+    size_t i = 0;
+#if defined(CURVE_SIMD) && defined(__AVX__)
+    const __m256d A4 = _mm256_set1_pd(t.A4), xy = _mm256_set1_pd(t.xy), x = _mm256_set1_pd(t.x), D = _mm256_set1_pd(t.D);
+    const __m256d y4 = _mm256_set1_pd(t.y4), D3 = _mm256_set1_pd(t.D3), A16y = _mm256_set1_pd(t.A16y);
+    const __m256d a4 = _mm256_set1_pd(t.a4), a2 = _mm256_set1_pd(t.a2), four = _mm256_set1_pd(4);
+    for (; i + 4 <= n; i += 4) {
+      __m256d p = _mm256_loadu_pd(ps + i);
+      __m256d G = _mm256_add_pd(_mm256_mul_pd(A4, _mm256_sub_pd(_mm256_add_pd(xy, p), D)), D);
+      __m256d c = _mm256_sub_pd(_mm256_mul_pd(y4, G), _mm256_div_pd(D3, _mm256_add_pd(x, p)));
+      __m256d nb = _mm256_add_pd(_mm256_mul_pd(four, G), A16y);
+      __m256d delta = _mm256_sub_pd(_mm256_mul_pd(nb, nb), _mm256_mul_pd(a4, c));
+      _mm256_storeu_pd(qs + i, _mm256_div_pd(_mm256_sub_pd(nb, _mm256_sqrt_pd(delta)), a2));
+    }
+#endif
+#if defined(CURVE_SIMD)
+    const __m128d A4_2 = _mm_set1_pd(t.A4), xy_2 = _mm_set1_pd(t.xy), x_2 = _mm_set1_pd(t.x), D_2 = _mm_set1_pd(t.D);
+    const __m128d y4_2 = _mm_set1_pd(t.y4), D3_2 = _mm_set1_pd(t.D3), A16y_2 = _mm_set1_pd(t.A16y);
+    const __m128d a4_2 = _mm_set1_pd(t.a4), a2_2 = _mm_set1_pd(t.a2), four_2 = _mm_set1_pd(4);
+    for (; i + 2 <= n; i += 2) {
+      __m128d p = _mm_loadu_pd(ps + i);
+      __m128d G = _mm_add_pd(_mm_mul_pd(A4_2, _mm_sub_pd(_mm_add_pd(xy_2, p), D_2)), D_2);
+      __m128d c = _mm_sub_pd(_mm_mul_pd(y4_2, G), _mm_div_pd(D3_2, _mm_add_pd(x_2, p)));
+      __m128d nb = _mm_add_pd(_mm_mul_pd(four_2, G), A16y_2);
+      __m128d delta = _mm_sub_pd(_mm_mul_pd(nb, nb), _mm_mul_pd(a4_2, c));
+      _mm_storeu_pd(qs + i, _mm_div_pd(_mm_sub_pd(nb, _mm_sqrt_pd(delta)), a2_2));
+    }
+#endif
+    for (; i < n; i++) {
+      double G = t.A4*(t.xy + ps[i] - t.D) + t.D;
+      double c = t.y4*G - t.D3/(t.x + ps[i]);
+      double nb = 4*G + t.A16y;
+      double delta = nb*nb - t.a4*c;
+      qs[i] = (nb - sqrt(delta)) / t.a2;
+    }
+  };
+
+  inline void p_to_q_batch(const double* __restrict ps, double* __restrict qs, size_t n, double A, double x, double y) {
+    _p_to_q_lanes(ps, qs, n, p_to_q_terms(A, x, y, cal_D(A, x, y)));
+  };
+
+  // every market needs its own D, and cbrt has no vector form here, so this one stays scalar
+  inline void p_to_q_markets(const double* __restrict ps, const double* __restrict As, const double* __restrict xs,
+                             const double* __restrict ys, double* __restrict qs, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      qs[i] = p_to_q(ps[i], As[i], xs[i], ys[i]);
+    }
+  };
+
+  // fee truncation is integer work and stays scalar, the solve runs through the lanes in chunks
+  inline void quote_swap_batch(const int64_t* __restrict amounts, int64_t* __restrict gots, size_t n, double A, double x, double y,
+                               uint8_t in_precision, uint8_t out_precision, double fee_rate, bool fee_on_in) {
+    p_to_q_terms t(A, x, y, cal_D(A, x, y));
+    double in_unit = pow(10, in_precision);
+    double out_unit = pow(10, out_precision);
+
+    const size_t chunk = 64;
+    double ps[chunk], qs[chunk];
+    for (size_t start = 0; start < n; start += chunk) {
+      size_t m = std::min(chunk, n - start);
+      for (size_t i = 0; i < m; i++) {
+        int64_t from = amounts[start + i];
+        if (fee_on_in) from -= (int64_t)((double)from * fee_rate);
+        ps[i] = (double)from / in_unit;
+      }
+      _p_to_q_lanes(ps, qs, m, t);
+      for (size_t i = 0; i < m; i++) {
+        int64_t got = qs[i] * out_unit;
+        if (!fee_on_in) got -= (int64_t)((double)got * fee_rate);
+        gots[start + i] = got;
+      }
+    }
+  };
+}
@@ -27,6 +27,21 @@ namespace pizzair {
       std::string invite_code = m.get(4);
       invitation ivt = _get_invitation(name(invite_code));
       _swap(lpsym, from, get_first_receiver(), quantity, expect, slippage_protection, ivt);
+    } else if (first == "swapexact") {
+      symbol_code lpsym = symbol_code(m.get(1));
+      uint64_t exact_out = atol(m.get(2).c_str());
+      check(exact_out > 0, "invalid output amount");
+
+      std::string invite_code = m.get(3);
+      invitation ivt = _get_invitation(name(invite_code));
+      _swap(lpsym, from, get_first_receiver(), quantity, 0, 0, ivt, exact_out);
+    } else if (first == "migrate") {
+      symbol_code target = symbol_code(m.get(1));
+      uint64_t min_lpamount = atol(m.get(2).c_str());
+      _migrate(from, get_first_receiver(), quantity, target, min_lpamount);
+    } else if (first == "flashrepay") {
+      symbol_code lpsym = symbol_code(m.get(1));
+      _flash_repay(lpsym, get_first_receiver(), quantity);
     } else if (first == "demand") {
       int sym_index = -1;
       if (m.get(1) != "") {
@@ -39,20 +54,36 @@ namespace pizzair {
     }
   };
 
-  void pizzair::supply(name account, symbol_code lpsym) {
+  supply_result pizzair::supply(name account, symbol_code lpsym) {
     require_auth(account);
 
     _check_allow(account, FEATURE_SUPPLY);
 
     auto mitr = markets.find(lpsym.raw());
     check(mitr != markets.end(), "market not found");
+    _check_not_flashing(lpsym);
 
     order_tlb orders(_self, lpsym.raw());
     auto itr = orders.find(account.value);
     check(itr != orders.end() && (itr->reserves[0].amount > 0 || itr->reserves[1].amount > 0), "not yet deposited");
 
-    asset deposits[2] = {itr->reserves[0], itr->reserves[1]};
-    double deposit_rs[2] = {asset2double(itr->reserves[0]), asset2double(itr->reserves[1])};
+    supply_result result = _supply(account, mitr, itr->reserves);
+    _flush_lend();
+
+    if (itr->has_lpquantity()) {
+      orders.modify(itr, _self, [&](auto& row) {
+        row.reserves[0].amount = 0;
+        row.reserves[1].amount = 0;
+      });
+    } else {
+      orders.erase(itr);
+    }
+
+    return result;
+  };
+
+  // adds deposits the contract already holds to a market and issues the lp tokens, lend movements are left in the ledger
+  supply_result pizzair::_supply(name account, market_tlb::const_iterator mitr, std::vector<asset> deposits) {
     if (mitr->lpamount == 0) {
       check(deposits[0].amount > 0 && deposits[1].amount > 0, "must deposited all tokens for first supply");
     }
@@ -63,13 +94,13 @@ namespace pizzair {
 
     for (auto i = 0; i < 2; i++) {
       if (mitr->lendables[i]) {
-        pizzalend::pztoken pz = pizzalend::get_pztoken_byanchor(mitr->syms[i]);
+        pizzalend::pzrate pz = _get_pzrate(mitr, i);
         double pzprice = pz.cal_pzprice();
 
         st_reserves[i] = pz.cal_anchor_quantity(reserves[i], pzprice);
         addeds[i] = pz.cal_pzquantity(deposits[i], pzprice);
         if (deposits[i].amount > 0) {
-          _transfer_out(LEND_CONTRACT, mitr->syms[i].get_contract(), deposits[i], "collateral");
+          _lend_collateral(mitr->syms[i].get_contract(), deposits[i]);
         }
       } else {
         st_reserves[i] = reserves[i];
@@ -79,94 +110,22 @@ namespace pizzair {
 
     print_f("added0: %, add1: % | ", addeds[0], addeds[1]);
 
-    std::vector<double> raw_rs = {asset2double(st_reserves[0]), asset2double(st_reserves[1])};
-    
-    double raw_ratio = 1;
-    if (raw_rs[1] > 0) {
-      raw_ratio = raw_rs[0] / raw_rs[1];
-    }
-
-    int extra_index = -1;
-    double extra_rs = 0;
-    double standard_deposit_rs[2] = {deposit_rs[0], deposit_rs[1]};
-    if (deposit_rs[1] == 0) {
-      extra_index = 0;
-      extra_rs = deposit_rs[0];
-      standard_deposit_rs[0] = 0;
-    } else if (deposit_rs[0] == 0) {
-      extra_index = 1;
-      extra_rs = deposit_rs[1];
-      standard_deposit_rs[1] = 0;
-    } else {
-      double deposit_ratio = deposit_rs[0] / deposit_rs[1];
-      if (deposit_ratio > raw_ratio) {
-        extra_index = 0;
-        extra_rs = deposit_rs[1] * (deposit_ratio - raw_ratio);
-        standard_deposit_rs[0] -= extra_rs;
-      } else if (deposit_ratio < raw_ratio) {
-        extra_index = 1;
-        extra_rs = deposit_rs[0] * (1/deposit_ratio - 1/raw_ratio);
-        standard_deposit_rs[1] -= extra_rs;
-      }
-    }
-
-    int64_t standard_lpamount = 0;
-    if (mitr->lpamount == 0) {
-      check(standard_deposit_rs[0] == standard_deposit_rs[1], "must deposit the same amount for first supply");
-      standard_lpamount = standard_deposit_rs[0] * pow(10, mitr->lptoken.precision()) * 2;
-    } else {
-      standard_lpamount = standard_deposit_rs[0] / raw_rs[0] * mitr->lpamount;
-    }
-
-    print_f("standard - deposit0: %, deposit1: %, lpamount: % | ", standard_deposit_rs[0], standard_deposit_rs[1], standard_lpamount);
-
     double A = _get_exact_leverage(mitr);
     print_f("current A: % | ", A);
 
-    print_f("extra index: %, extra_rs: % | ", extra_index, extra_rs);
+    int64_t deposit_amounts[2] = {deposits[0].amount, deposits[1].amount};
+    int64_t reserve_amounts[2] = {st_reserves[0].amount, st_reserves[1].amount};
+    uint8_t precisions[2] = {deposits[0].symbol.precision(), deposits[1].symbol.precision()};
+    supply_quote quote = quote_supply(deposit_amounts, reserve_amounts, precisions, mitr->lpamount, mitr->lptoken.precision(), A);
+    check(quote.error != SUPPLY_FIRST_UNEQUAL, "must deposit the same amount for first supply");
+    check(quote.error != SUPPLY_DISPROPORTION, "failed to add liquidity due to pool disproportion");
+    check(quote.error != SUPPLY_UNSOLVED, "invalid input, please add the coins in a balanced proportion");
 
-    int64_t extra_lpamount = 0;
-    int64_t extra_amount = extra_rs * pow(10, deposits[extra_index].symbol.precision());
+    print_f("extra index: %, lpamount: % | ", quote.extra_index, quote.lpamount);
 
-    if (extra_rs <= 0.0001) {
-      addeds[extra_index].amount *= (1 - (double)extra_amount/deposits[extra_index].amount);
-      deposits[extra_index].amount -= extra_amount;
-    } else {
-      if (extra_index >= 0 && extra_amount > 1) {
-        int other_index = extra_index == 0 ? 1 : 0;
-
-        double latest_rs[2] = {raw_rs[0] + standard_deposit_rs[0], raw_rs[1] + standard_deposit_rs[1]};
-        check(extra_rs <= latest_rs[extra_index], "failed to add liquidity due to pool disproportion");
-        double x = latest_rs[extra_index];
-        double y = latest_rs[other_index];
-        double n = extra_rs;
-
-        double max_price = cal_price(A, x, y);
-        double min_price = cal_price(A, x + n, y);
-
-        print_f("max price: %, min price: % | ", max_price, min_price);
-
-        int times = 0;
-        double price, p, q;
-        while (true) {
-          times++;
-          check(times <= 10, "invalid input, please add the coins in a balanced proportion");
-          price = (max_price + min_price) / 2;
-          print_f("#%, price: % | ", times, price);
-          p = y * n / ((x + n) * price + y);
-          q = p_to_q(p, A, x, y);
-          double verify = q * (x + p) / ((n - p) * (y - q)) - 1;
-          if (verify >= 0.0005) {
-            min_price = price;
-          } else if (verify < 0) {
-            max_price = price;
-          } else {
-            break;
-          }
-        }
-        extra_lpamount = (n - p) / (x + p) * (mitr->lpamount + standard_lpamount);
-        print_f("p: %, q: %, extra lpamount: % | ", p, q, extra_lpamount);
-      }
+    if (quote.dropped > 0) {
+      addeds[quote.extra_index].amount *= (1 - (double)quote.dropped/deposits[quote.extra_index].amount);
+      deposits[quote.extra_index].amount -= quote.dropped;
     }
 
     print_f("added0: %, add1: % | ", addeds[0], addeds[1]);
@@ -179,12 +138,12 @@ namespace pizzair {
     double price0 = cal_price(A, rs[0], rs[1]);
     double price1 = cal_price(A, rs[1], rs[0]);
     
-    int64_t lpamount = standard_lpamount + extra_lpamount;
+    int64_t lpamount = quote.lpamount;
     uint64_t minsupply = get_minsupply(mitr->psym(), mitr->lptoken.precision());
     check(lpamount >= minsupply, "supply amount is too small");
 
     asset lpquantity = asset(lpamount, mitr->lptoken);
-    _log_supply(account, mitr->lptoken.code(), deposits, lpquantity);
+    _log_supply(account, mitr->lptoken.code(), deposits.data(), lpquantity);
 
     markets.modify(mitr, _self, [&](auto& row) {
       row.reserves[0] += addeds[0];
@@ -196,6 +155,8 @@ namespace pizzair {
 
     _log_upmarket(mitr->lptoken.code(), st_reserves, mitr->prices, mitr->lpamount);
 
+    _snapshot_market(mitr, st_reserves, A);
+
     std::vector<asset> principals = {asset(0, st_reserves[0].symbol), asset(0, st_reserves[1].symbol)};
     double ratio = (double)lpamount / mitr->lpamount;
     principals[0].amount = st_reserves[0].amount * ratio;
@@ -204,7 +165,63 @@ namespace pizzair {
     
     _issue_lptoken(account, lpquantity);
 
-    orders.erase(itr);
+    _stat_supply(mitr);
+
+    return supply_result{deposits, lpquantity, st_reserves};
+  };
+
+  swap_result pizzair::swap(name account, symbol_code lpsym, extended_symbol sym, uint64_t expect, uint32_t slippage, name invite_code) {
+    require_auth(account);
+
+    if (expect > 0) {
+      check(slippage >= 10 && slippage <= 500, "slippage protection should be between 1‰ and 5%");
+    }
+
+    auto mitr = markets.require_find(lpsym.raw(), "market not found");
+    int index = -1;
+    for (int i = 0; i <= 1; i++) {
+      if (mitr->syms[i] == sym) {
+        index = i;
+      }
+    }
+    check(index >= 0, "market does not match");
+
+    order_tlb orders(_self, lpsym.raw());
+    auto itr = orders.find(account.value);
+    check(itr != orders.end() && itr->reserves[index].amount > 0, "not yet deposited");
+
+    asset quantity = itr->reserves[index];
+    int other_index = index == 0 ? 1 : 0;
+    if (itr->reserves[other_index].amount == 0 && !itr->has_lpquantity()) {
+      orders.erase(itr);
+    } else {
+      orders.modify(itr, _self, [&](auto& row) {
+        row.reserves[index].amount = 0;
+      });
+    }
+
+    return _swap(lpsym, account, sym.get_contract(), quantity, expect, slippage, _get_invitation(invite_code));
+  };
+
+  demand_result pizzair::demand(name account, asset quantity, int sym_index) {
+    require_auth(account);
+
+    check(sym_index >= -1 && sym_index <= 1, "invalid symbol index");
+    check(quantity.amount > 0, "invalid quantity");
+
+    order_tlb orders(_self, quantity.symbol.code().raw());
+    auto itr = orders.find(account.value);
+    check(itr != orders.end() && itr->has_lpquantity() && itr->lpquantity.value() >= quantity, "not yet deposited");
+
+    if (itr->lpquantity.value() == quantity && itr->reserves[0].amount == 0 && itr->reserves[1].amount == 0) {
+      orders.erase(itr);
+    } else {
+      orders.modify(itr, _self, [&](auto& row) {
+        row.lpquantity.value() -= quantity;
+      });
+    }
+
+    return _demand(account, LPTOKEN_CONTRACT, quantity, sym_index);
   };
 
   void pizzair::_create_lptoken(asset maximum_supply) {
@@ -235,7 +252,8 @@ namespace pizzair {
   };
 
   void pizzair::_deposit(symbol_code lpsym, name account, name contract, asset quantity) {
-    _check_allow(account, FEATURE_SUPPLY);
+    bool is_lptoken = contract == LPTOKEN_CONTRACT;
+    _check_allow(account, is_lptoken ? FEATURE_DEMAND : FEATURE_SUPPLY);
 
     market m = markets.get(lpsym.raw(), "market not found");
 
@@ -245,7 +263,20 @@ namespace pizzair {
       itr = orders.emplace(_self, [&](auto& row) {
         row.account = account;
         row.reserves = {asset(0, m.syms[0].get_symbol()), asset(0, m.syms[1].get_symbol())};
+        row.lpquantity.emplace(asset(0, m.lptoken));
+        row.created_at.emplace(current_secs());
+      });
+    }
+
+    if (is_lptoken) {
+      check(quantity.symbol == m.lptoken, "market does not match");
+      orders.modify(itr, _self, [&](auto& row) {
+        if (!row.lpquantity.has_value()) {
+          row.lpquantity.emplace(asset(0, m.lptoken));
+        }
+        row.lpquantity.value() += quantity;
       });
+      return;
     }
 
     int index = -1;
@@ -261,15 +292,75 @@ namespace pizzair {
     });
   };
 
-  void pizzair::_swap(symbol_code lpsym, name account, name contract, asset quantity, uint64_t expect, uint32_t slippage, invitation ivt) {
+  void pizzair::cancelorder(name account, symbol_code lpsym) {
+    require_auth(account);
+
+    market m = markets.get(lpsym.raw(), "market not found");
+
+    order_tlb orders(_self, lpsym.raw());
+    auto itr = orders.require_find(account.value, "order not found");
+    _refund_order(m, *itr);
+    orders.erase(itr);
+  };
+
+  // skips names accounts whose refund transfer fails, their orders stay until they cancel them
+  void pizzair::sweeporders(symbol_code lpsym, uint32_t max_rows, std::vector<name> skips) {
+    market m = markets.get(lpsym.raw(), "market not found");
+
+    order_tlb orders(_self, lpsym.raw());
+    auto orders_bycreated = orders.get_index<name("bycreated")>();
+    uint32_t expired_before = current_secs() - ORDER_EXPIRE_SECS;
+
+    auto itr = orders_bycreated.begin();
+    for (uint32_t rows = 0; itr != orders_bycreated.end() && rows < max_rows; rows++) {
+      if (itr->by_created() > expired_before) break;
+      if (std::find(skips.begin(), skips.end(), itr->account) != skips.end()) {
+        itr++;
+        continue;
+      }
+      _refund_order(m, *itr);
+      itr = orders_bycreated.erase(itr);
+    }
+  };
+
+  // orders deposited before created_at existed can only be reached by primary key
+  name pizzair::sweeplegacy(symbol_code lpsym, name cursor, uint32_t max_rows, std::vector<name> skips) {
+    require_auth(permission_level{ADMIN_ACCOUNT, name("manager")});
+
+    market m = markets.get(lpsym.raw(), "market not found");
+
+    order_tlb orders(_self, lpsym.raw());
+    auto itr = orders.lower_bound(cursor.value);
+    for (uint32_t rows = 0; itr != orders.end() && rows < max_rows; rows++) {
+      if (itr->created_at.has_value() || std::find(skips.begin(), skips.end(), itr->account) != skips.end()) {
+        itr++;
+        continue;
+      }
+      _refund_order(m, *itr);
+      itr = orders.erase(itr);
+    }
+
+    return itr == orders.end() ? name() : itr->account;
+  };
+
+  void pizzair::claim(name account, extended_symbol sym) {
+    require_auth(account);
+
+    claimable_tlb claimables(_self, account.value);
+    auto claimables_byextsym = claimables.get_index<name("byextsym")>();
+    auto itr = claimables_byextsym.require_find((uint128_t)sym.get_contract().value << 64 | sym.get_symbol().raw(), "nothing to claim");
+    extended_asset balance = itr->balance;
+    claimables_byextsym.erase(itr);
+
+    _transfer_out(account, balance.contract, balance.quantity, "claim");
+  };
+
+  swap_result pizzair::_swap(symbol_code lpsym, name account, name contract, asset quantity, uint64_t expect, uint32_t slippage, invitation ivt, uint64_t exact_out) {
     _check_allow(account, FEATURE_SWAP);
 
     auto mitr = markets.find(lpsym.raw());
     check(mitr != markets.end(), "market not found");
-
-    std::vector<asset> reserves = mitr->reserves;
-
-    std::vector<asset> st_reserves = {asset(0, mitr->syms[0].get_symbol()), asset(0, mitr->syms[1].get_symbol())};
+    _check_not_flashing(lpsym);
 
     extended_symbol sym = extended_symbol(quantity.symbol, contract);
 
@@ -281,13 +372,68 @@ namespace pizzair {
     }
     check(in_index >= 0, "market does not match");
 
-    asset from_quantity = quantity;
-    
+    if (mitr->is_batched()) {
+      check(exact_out == 0, "exact output swaps are not available on a batched market");
+      uint64_t min_out = 0;
+      if (slippage > 0 && expect > 0) {
+        min_out = expect * (1 - (double)slippage / 10000);
+      }
+      return _queue_intent(mitr, in_index, account, quantity, min_out);
+    }
+
+    bool in_lendable = mitr->lendables[in_index];
+    bool out_lendable = mitr->lendables[in_index == 0 ? 1 : 0];
+    if (in_lendable && out_lendable) {
+      return _swap_kernel<true, true>(mitr, in_index, account, contract, quantity, expect, slippage, ivt, exact_out);
+    } else if (in_lendable) {
+      return _swap_kernel<true, false>(mitr, in_index, account, contract, quantity, expect, slippage, ivt, exact_out);
+    } else if (out_lendable) {
+      return _swap_kernel<false, true>(mitr, in_index, account, contract, quantity, expect, slippage, ivt, exact_out);
+    }
+    return _swap_kernel<false, false>(mitr, in_index, account, contract, quantity, expect, slippage, ivt, exact_out);
+  };
+
+  template<bool in_lendable, bool out_lendable>
+  swap_result pizzair::_swap_kernel(market_tlb::const_iterator mitr, int in_index, name account, name contract, asset quantity, uint64_t expect, uint32_t slippage, invitation ivt, uint64_t exact_out) {
     int out_index = in_index == 0 ? 1 : 0;
 
+    std::vector<asset> reserves = mitr->reserves;
+    std::vector<asset> st_reserves = reserves;
+
+    pizzalend::pzrate in_pz;
+    double in_pzprice = 0;
+    if constexpr (in_lendable) {
+      in_pz = _get_pzrate(mitr, in_index);
+      in_pzprice = in_pz.cal_pzprice();
+      st_reserves[in_index] = in_pz.cal_anchor_quantity(reserves[in_index], in_pzprice);
+    }
+
+    pizzalend::pzrate out_pz;
+    double out_pzprice = 0;
+    if constexpr (out_lendable) {
+      out_pz = _get_pzrate(mitr, out_index);
+      out_pzprice = out_pz.cal_pzprice();
+      st_reserves[out_index] = out_pz.cal_anchor_quantity(reserves[out_index], out_pzprice);
+    }
+
+    double p, q, A;
+    A = _get_exact_leverage(mitr);
+    double x = asset2double(st_reserves[in_index]);
+    double y = asset2double(st_reserves[out_index]);
+
     double fee_rate = decimal2double(mitr->config.fee_rate);
     market_fee fee_conf = _get_fee_conf(mitr->lptoken);
 
+    asset refund = asset(0, quantity.symbol);
+    if (exact_out > 0) {
+      int64_t amount = cal_exact_in(exact_out, A, x, y, quantity.symbol.precision(), mitr->syms[out_index].get_symbol().precision(), fee_rate, fee_conf.index == in_index);
+      check(amount <= quantity.amount, "insufficient quantity for the exact output");
+      refund.amount = quantity.amount - amount;
+      quantity.amount = amount;
+    }
+
+    asset from_quantity = quantity;
+
     asset fee = asset(0, mitr->syms[fee_conf.index].get_symbol());
     asset admin_fee = asset(0, fee.symbol);
 
@@ -301,42 +447,20 @@ namespace pizzair {
       from_quantity -= fee;
     }
     
-    double p, q, A;
     p = asset2double(from_quantity);
-    A = _get_exact_leverage(mitr);
 
     asset st_incr = from_quantity;
     if (fee_conf.index == in_index) {
       st_incr += (fee - admin_fee);
     }
-    asset incr = asset(0, reserves[in_index].symbol);
-    if (mitr->lendables[in_index]) {
-      pizzalend::pztoken pz = pizzalend::get_pztoken_byanchor(sym);
-      double pzprice = pz.cal_pzprice();
-      st_reserves[in_index] = pz.cal_anchor_quantity(reserves[in_index], pzprice);
-      incr = pz.cal_pzquantity(st_incr, pzprice);
-      _transfer_out(LEND_CONTRACT, contract, from_quantity, "collateral");
+    if constexpr (in_lendable) {
+      reserves[in_index] += in_pz.cal_pzquantity(st_incr, in_pzprice);
+      _lend_collateral(contract, from_quantity);
     } else {
-      st_reserves[in_index] = reserves[in_index];
-      incr = st_incr;
+      reserves[in_index] += st_incr;
     }
-
-    double x = asset2double(st_reserves[in_index]);
-    reserves[in_index] += incr;
     st_reserves[in_index] += st_incr;
 
-    pizzalend::pztoken out_pz;
-    double out_pzprice = 0;
-    if (mitr->lendables[out_index]) {
-      out_pz = pizzalend::get_pztoken_byanchor(mitr->syms[out_index]);
-      out_pzprice = out_pz.cal_pzprice();
-
-      st_reserves[out_index] = out_pz.cal_anchor_quantity(reserves[out_index], out_pzprice);
-    } else {
-      st_reserves[out_index] = reserves[out_index];
-    }
-    double y = asset2double(st_reserves[out_index]);
-    
     q = p_to_q(p, A, x, y);
     asset to_quantity = asset(q * pow(10, mitr->syms[out_index].get_symbol().precision()), mitr->syms[out_index].get_symbol());
 
@@ -353,11 +477,16 @@ namespace pizzair {
       to_quantity -= fee;
     }
 
+    if (exact_out > 0) {
+      // rounding surplus of the solved input stays in the pool
+      check(to_quantity.amount >= exact_out, "failed to solve the exact output");
+      to_quantity.amount = exact_out;
+    }
+
     if (fee_rate > 0) {
       check(admin_fee.amount > 0, "swap amount is too small");
     }
 
-    print_f("pay: %, got: %, fee: % ", from_quantity, to_quantity, fee);
     _log_swap(account, mitr->lptoken.code(), from_quantity, to_quantity, fee);
 
     asset st_decr = to_quantity;
@@ -366,36 +495,558 @@ namespace pizzair {
     }
     check(st_reserves[out_index] >= st_decr, "insufficient reserve");
 
-    asset decr = asset(0, reserves[out_index].symbol);
-    if (mitr->lendables[out_index]) {
-      action(
-        permission_level{_self, name("active")},
-        LEND_CONTRACT,
-        name("withdraw"),
-        std::make_tuple(_self, mitr->syms[out_index].get_contract(), st_decr)
-      ).send();
-      decr = out_pz.cal_pzquantity(st_decr, out_pzprice);
+    if constexpr (out_lendable) {
+      _lend_withdraw(mitr->syms[out_index].get_contract(), st_decr);
+      asset decr = out_pz.cal_pzquantity(st_decr, out_pzprice);
       check(reserves[out_index] >= decr, "insufficient reserve");
+      reserves[out_index] -= decr;
     } else {
-      decr = st_decr;
+      reserves[out_index] -= st_decr;
     }
-
-    reserves[out_index] -= decr;
     st_reserves[out_index] -= st_decr;
 
+    _flush_lend();
     _transfer_out(account, mitr->syms[out_index].get_contract(), to_quantity, "swap");
 
+    if (refund.amount > 0) {
+      _transfer_out(account, contract, refund, "refund");
+    }
+
+    asset lp_fee = fee - admin_fee;
     if (invite_fee.amount > 0 && ivt.is_valid()) {
       if (invite_fee > admin_fee) invite_fee = admin_fee;
       _transfer_out(ivt.account, mitr->syms[fee_conf.index].get_contract(), invite_fee, "invite rebate");
       admin_fee -= invite_fee;
+    } else {
+      invite_fee.amount = 0;
     }
 
     if (admin_fee.amount > 0) {
       _transfer_out(PLANB_CONTRACT, mitr->syms[fee_conf.index].get_contract(), admin_fee, "admin fee");
     }
 
+    _stat_swap(mitr, in_index, quantity, to_quantity, fee_conf.index, lp_fee, admin_fee, invite_fee);
+
     _update_market_reserve(mitr, st_reserves, reserves, mitr->lpamount);
+
+    return swap_result{quantity, to_quantity, fee, st_reserves};
+  };
+
+  swap_result pizzair::_queue_intent(market_tlb::const_iterator mitr, int in_index, name account, asset quantity, uint64_t min_out) {
+    check(quantity.amount > 0, "invalid quantity");
+
+    double fee_rate = decimal2double(mitr->config.fee_rate);
+    market_fee fee_conf = _get_fee_conf(mitr->lptoken);
+    int64_t fee = (double)quantity.amount * fee_rate;
+    int64_t admin_fee = (double)fee * (1 - decimal2double(fee_conf.lp_rate));
+    if (fee_rate > 0) {
+      check(admin_fee > 0, "swap amount is too small");
+    }
+
+    intent_tlb intents(_self, mitr->lptoken.code().raw());
+    uint64_t id = intents.available_primary_key();
+    if (intents.begin() != intents.end()) {
+      check(id - intents.begin()->id < BATCH_MAX_INTENTS, "batch is full, wait for settlement");
+    }
+
+    intents.emplace(_self, [&](auto& row) {
+      row.id = id;
+      row.account = account;
+      row.in_index = in_index;
+      row.quantity = quantity;
+      row.min_out = min_out;
+      row.created_at = current_secs();
+    });
+
+    // nothing is paid until settlebatch
+    int out_index = in_index == 0 ? 1 : 0;
+    return swap_result{quantity, asset(0, mitr->syms[out_index].get_symbol()), asset(0, quantity.symbol), {}};
+  };
+
+  void pizzair::setbatch(symbol_code lpsym, uint32_t window_secs) {
+    require_auth(permission_level{ADMIN_ACCOUNT, name("manager")});
+
+    auto mitr = markets.require_find(lpsym.raw(), "market not found");
+    check(mitr->ramp.has_value(), "sync the leverage ramp first");
+
+    markets.modify(mitr, _self, [&](auto& row) {
+      row.batch_secs.emplace(window_secs);
+    });
+  };
+
+  void pizzair::cancelintent(name account, symbol_code lpsym, uint64_t id) {
+    require_auth(account);
+
+    market m = markets.get(lpsym.raw(), "market not found");
+
+    intent_tlb intents(_self, lpsym.raw());
+    auto itr = intents.require_find(id, "intent not found");
+    check(itr->account == account, "not your intent");
+    _transfer_out(account, m.syms[itr->in_index].get_contract(), itr->quantity, "refund");
+    intents.erase(itr);
+  };
+
+  // clears queued swaps at one price: opposing flow is matched between traders and only the
+  // imbalance trades against the curve. fees are taken on the input of every intent.
+  void pizzair::settlebatch(symbol_code lpsym, uint32_t max_rows) {
+    check(max_rows > 0, "max rows should be positive");
+
+    auto mitr = markets.require_find(lpsym.raw(), "market not found");
+    _check_not_flashing(lpsym);
+
+    intent_tlb intents(_self, lpsym.raw());
+    check(intents.begin() != intents.end(), "no swaps queued");
+    uint32_t window_secs = mitr->is_batched() ? mitr->batch_secs.value() : 0;
+    check(current_secs() - intents.begin()->created_at >= window_secs, "batch window is still open");
+
+    std::vector<intent> batch;
+    for (auto itr = intents.begin(); itr != intents.end() && batch.size() < max_rows;) {
+      batch.push_back(*itr);
+      itr = intents.erase(itr);
+    }
+
+    std::vector<asset> reserves = mitr->reserves;
+    std::vector<asset> st_reserves = mitr->reserves;
+    pizzalend::pzrate pzs[2];
+    double pzprices[2] = {0, 0};
+    for (int i = 0; i <= 1; i++) {
+      if (mitr->lendables[i]) {
+        pzs[i] = _get_pzrate(mitr, i);
+        pzprices[i] = pzs[i].cal_pzprice();
+        st_reserves[i] = pzs[i].cal_anchor_quantity(reserves[i], pzprices[i]);
+      }
+    }
+
+    double A = _get_exact_leverage(mitr);
+    double fee_rate = decimal2double(mitr->config.fee_rate);
+    double lp_rate = decimal2double(_get_fee_conf(mitr->lptoken).lp_rate);
+    double units[2] = {pow(10, mitr->syms[0].get_symbol().precision()), pow(10, mitr->syms[1].get_symbol().precision())};
+
+    size_t n = batch.size();
+    std::vector<int64_t> nets(n), admin_fees(n), outs(n);
+    for (size_t k = 0; k < n; k++) {
+      int64_t fee = (double)batch[k].quantity.amount * fee_rate;
+      admin_fees[k] = (double)fee * (1 - lp_rate);
+      nets[k] = batch[k].quantity.amount - fee;
+    }
+
+    // intents below their minimum are refunded and the rest cleared again
+    std::vector<bool> fills(n, true);
+    double price = 0;
+    bool settled = false;
+    while (!settled) {
+      int64_t totals[2] = {0, 0};
+      for (size_t k = 0; k < n; k++) {
+        if (fills[k]) totals[batch[k].in_index] += nets[k];
+      }
+      if (totals[0] == 0 && totals[1] == 0) break;
+
+      double x = asset2double(st_reserves[0]);
+      double y = asset2double(st_reserves[1]);
+      price = clear_price(A, x, y, totals[0] / units[0], totals[1] / units[1]);
+
+      // the net seller side s pays the pool, pots are what each side is paid out of
+      int s = totals[0] / units[0] * price >= totals[1] / units[1] ? 0 : 1;
+      int o = s == 0 ? 1 : 0;
+      double price_s = s == 0 ? price : 1 / price;
+      double dx = totals[s] / units[s] - totals[o] / units[o] / price_s;
+
+      int64_t pool_in = std::min(std::max((int64_t)ceil(dx * units[s]), (int64_t)0), totals[s]);
+      int64_t pool_out = 0;
+      if (pool_in > 0) {
+        pool_out = p_to_q(pool_in / units[s], A, s == 0 ? x : y, s == 0 ? y : x) * units[o];
+      }
+      check(pool_out < st_reserves[o].amount, "insufficient reserve");
+
+      int64_t pots[2];
+      pots[o] = totals[o] + pool_out;
+      pots[s] = totals[s] - pool_in;
+
+      settled = true;
+      for (size_t k = 0; k < n; k++) {
+        if (!fills[k]) continue;
+        int in_index = batch[k].in_index;
+        int out_index = in_index == 0 ? 1 : 0;
+        outs[k] = (uint128_t)nets[k] * pots[out_index] / totals[in_index];
+        if (outs[k] < batch[k].min_out || outs[k] == 0) {
+          fills[k] = false;
+          settled = false;
+        }
+      }
+    }
+
+    std::vector<asset> ins = {asset(0, mitr->syms[0].get_symbol()), asset(0, mitr->syms[1].get_symbol())};
+    std::vector<asset> paids = ins;
+    std::vector<asset> lp_fees = ins;
+    std::vector<asset> admins = ins;
+    uint32_t fills_by_side[2] = {0, 0};
+    uint32_t count = 0;
+    for (size_t k = 0; k < n; k++) {
+      if (!fills[k]) continue;
+      int in_index = batch[k].in_index;
+      int out_index = in_index == 0 ? 1 : 0;
+      ins[in_index].amount += batch[k].quantity.amount;
+      admins[in_index].amount += admin_fees[k];
+      lp_fees[in_index].amount += batch[k].quantity.amount - nets[k] - admin_fees[k];
+      paids[out_index].amount += outs[k];
+      fills_by_side[in_index]++;
+      count++;
+    }
+
+    // rounding leftovers of the payouts stay in the pool
+    for (int i = 0; i <= 1; i++) {
+      asset delta = ins[i] - admins[i] - paids[i];
+      if (delta.amount == 0) continue;
+
+      check(st_reserves[i] + delta > asset(0, delta.symbol), "insufficient reserve");
+      if (!mitr->lendables[i]) {
+        reserves[i] += delta;
+      } else if (delta.amount > 0) {
+        _lend_collateral(mitr->syms[i].get_contract(), delta);
+        reserves[i] += pzs[i].cal_pzquantity(delta, pzprices[i]);
+      } else {
+        _lend_withdraw(mitr->syms[i].get_contract(), -delta);
+        asset decr = pzs[i].cal_pzquantity(-delta, pzprices[i]);
+        check(reserves[i] >= decr, "insufficient reserve");
+        reserves[i] -= decr;
+      }
+      st_reserves[i] += delta;
+    }
+
+    // credited rather than pushed, one account refusing transfers must not hold up the batch
+    _flush_lend();
+    for (size_t k = 0; k < n; k++) {
+      int in_index = batch[k].in_index;
+      int out_index = in_index == 0 ? 1 : 0;
+      if (fills[k]) {
+        _credit(batch[k].account, mitr->syms[out_index].get_contract(), asset(outs[k], mitr->syms[out_index].get_symbol()));
+      } else {
+        _credit(batch[k].account, mitr->syms[in_index].get_contract(), batch[k].quantity);
+      }
+    }
+
+    for (int i = 0; i <= 1; i++) {
+      if (admins[i].amount > 0) {
+        _transfer_out(PLANB_CONTRACT, mitr->syms[i].get_contract(), admins[i], "admin fee");
+      }
+      if (ins[i].amount > 0) {
+        int out_index = i == 0 ? 1 : 0;
+        _stat_swap(mitr, i, ins[i], paids[out_index], i, lp_fees[i], admins[i], asset(0, admins[i].symbol), fills_by_side[i]);
+      }
+    }
+
+    _log_batch(lpsym, count, price);
+
+    if (count > 0) {
+      _update_market_reserve(mitr, st_reserves, reserves, mitr->lpamount);
+    }
+  };
+
+  // moves an lp share into another market sharing a token: the share is withdrawn into the shared
+  // tokens and supplied to the target inside the contract, lend movements of both sides are netted
+  void pizzair::_migrate(name account, name contract, asset quantity, symbol_code target, uint64_t min_lpamount) {
+    _check_allow(account, FEATURE_DEMAND);
+    _check_allow(account, FEATURE_SUPPLY);
+
+    check(contract == LPTOKEN_CONTRACT, "only lptoken can migrate");
+
+    symbol_code lpsym = quantity.symbol.code();
+    check(lpsym != target, "cannot migrate into the same market");
+    auto mitr = markets.find(lpsym.raw());
+    check(mitr != markets.end() && mitr->lptoken == quantity.symbol, "market not found");
+    check(mitr->lpamount >= quantity.amount, "insufficient lpamount");
+    auto titr = markets.require_find(target.raw(), "target market not found");
+    _check_not_flashing(lpsym);
+    _check_not_flashing(target);
+
+    // targets[i] is where the i-th token of the source sits in the target, -1 if it does not
+    int targets[2] = {-1, -1};
+    for (int i = 0; i <= 1; i++) {
+      for (int j = 0; j <= 1; j++) {
+        if (mitr->syms[i] == titr->syms[j]) {
+          targets[i] = j;
+        }
+      }
+    }
+    check(targets[0] >= 0 || targets[1] >= 0, "markets do not share a token");
+
+    std::vector<asset> deposits = {asset(0, titr->syms[0].get_symbol()), asset(0, titr->syms[1].get_symbol())};
+    extended_asset admin_fee;
+    if (targets[0] >= 0 && targets[1] >= 0) {
+      demand_result withdrawal = _withdraw(mitr, quantity);
+      _log_demand(account, lpsym, quantity, withdrawal.gots);
+      for (int i = 0; i <= 1; i++) {
+        deposits[targets[i]] = withdrawal.gots[i];
+      }
+    } else {
+      // a single-sided withdrawal swaps the other side through the curve
+      _check_allow(account, FEATURE_SWAP);
+      int out_index = targets[0] >= 0 ? 0 : 1;
+      single_withdrawal withdrawal = _withdraw_single(mitr, quantity, out_index);
+      _log_demand(account, lpsym, quantity, withdrawal.result.gots);
+      deposits[targets[out_index]] = withdrawal.result.gots[out_index];
+      admin_fee = withdrawal.admin_fee;
+    }
+
+    _decr_liqdt(account, mitr, quantity.amount);
+    _retire_lptoken(quantity);
+    _stat_demand(mitr);
+
+    supply_result supplied = _supply(account, titr, deposits);
+    check(supplied.lpquantity.amount >= min_lpamount, "the slippage of this migration is too high");
+
+    _flush_lend();
+    if (admin_fee.quantity.amount > 0) {
+      _transfer_out(PLANB_CONTRACT, admin_fee.contract, admin_fee.quantity, "admin fee");
+    }
+  };
+
+  // writes nothing, positions come in lp symbol order and next is empty after the last one
+  positions_result pizzair::positions(name account, symbol_code cursor, uint32_t max_rows) {
+    check(max_rows > 0, "max rows should be positive");
+
+    positions_result result;
+    auto liqdts_byacclpsym = liqdts.get_index<name("byacclpsym")>();
+    auto itr = liqdts_byacclpsym.lower_bound(raw(account.value, cursor.raw()));
+    for (uint32_t rows = 0; itr != liqdts_byacclpsym.end() && itr->account == account && rows < max_rows; itr++, rows++) {
+      auto mitr = markets.require_find(itr->lptoken.code().raw(), "market not found");
+      double ratio = mitr->lpamount > 0 ? (double)itr->lpamount / mitr->lpamount : 0;
+
+      position pos = {asset(itr->lpamount, mitr->lptoken), {}, itr->reserves};
+      for (int i = 0; i <= 1; i++) {
+        asset redeemable = asset(mitr->reserves[i].amount * ratio, mitr->reserves[i].symbol);
+        if (mitr->lendables[i]) {
+          redeemable = _peek_pzrate(mitr, i).cal_anchor_quantity(redeemable);
+        }
+        pos.redeemables.push_back(redeemable);
+      }
+      result.positions.push_back(pos);
+    }
+
+    if (itr != liqdts_byacclpsym.end() && itr->account == account) {
+      result.next = itr->lptoken.code();
+    }
+    return result;
+  };
+
+  // writes nothing, meant to be called in read-only transactions to page through the state
+  export_page pizzair::exportstate(uint8_t section, uint64_t cursor, uint32_t max_rows) {
+    check(max_rows > 0, "max rows should be positive");
+
+    export_page page = {snapshot::VERSION, section, 0, {}};
+    if (section == snapshot::MARKETS) {
+      auto itr = markets.lower_bound(cursor);
+      for (uint32_t rows = 0; itr != markets.end() && rows < max_rows; itr++, rows++) {
+        _append_record(page.data, _market_record(itr));
+      }
+      page.next = itr == markets.end() ? 0 : itr->primary_key();
+    } else if (section == snapshot::POSITIONS) {
+      auto itr = liqdts.lower_bound(cursor);
+      for (uint32_t rows = 0; itr != liqdts.end() && rows < max_rows; itr++, rows++) {
+        snapshot::position_record record = {};
+        record.id = itr->id;
+        record.account = itr->account.value;
+        record.lptoken = itr->lptoken.raw();
+        record.lpamount = itr->lpamount;
+        for (int i = 0; i <= 1; i++) {
+          record.principals[i] = itr->reserves[i].amount;
+        }
+        _append_record(page.data, record);
+      }
+      page.next = itr == liqdts.end() ? 0 : itr->id;
+    } else {
+      check(false, "unknown section");
+    }
+
+    return page;
+  };
+
+  snapshot::market_record pizzair::_market_record(market_tlb::const_iterator mitr) {
+    snapshot::market_record record = {};
+    record.lptoken = mitr->lptoken.raw();
+    record.lpamount = mitr->lpamount;
+    record.fee_rate = decimal2double(mitr->config.fee_rate);
+
+    for (int i = 0; i <= 1; i++) {
+      record.contracts[i] = mitr->syms[i].get_contract().value;
+      record.syms[i] = mitr->syms[i].get_symbol().raw();
+      record.pzreserves[i] = mitr->reserves[i].amount;
+      record.reserves[i] = mitr->reserves[i].amount;
+      record.prices[i] = mitr->prices[i];
+      record.lendables[i] = mitr->lendables[i];
+      if (mitr->lendables[i]) {
+        pizzalend::pzrate pz = _peek_pzrate(mitr, i);
+        record.pzprices[i] = pz.cal_pzprice();
+        record.reserves[i] = pz.cal_anchor_quantity(mitr->reserves[i], record.pzprices[i]).amount;
+      }
+    }
+
+    leverage_ramp ramp = _get_ramp(mitr);
+    record.leverage = _ramp_leverage(ramp.from, ramp.target, ramp.begined_at, ramp.effective_secs);
+    record.target_leverage = ramp.target;
+    record.ramp_begined_at = ramp.begined_at;
+    record.ramp_effective_secs = ramp.effective_secs;
+
+    // markets without an mfee row use the defaults _get_fee_conf would create
+    record.lp_rate = 0.5;
+    auto fitr = mfees.find(mitr->lptoken.code().raw());
+    if (fitr != mfees.end()) {
+      record.lp_rate = decimal2double(fitr->lp_rate);
+      record.fee_index = fitr->index;
+    }
+
+    return record;
+  };
+
+  void pizzair::flashswap(name account, symbol_code lpsym, extended_symbol sym, uint64_t amount) {
+    require_auth(account);
+    _check_allow(account, FEATURE_SWAP);
+
+    auto mitr = markets.require_find(lpsym.raw(), "market not found");
+    _check_not_flashing(lpsym);
+    // a flash swap trades the curve at once, on a batched market that would bypass the uniform price
+    check(!mitr->is_batched(), "market is batched");
+
+    int out_index = -1;
+    for (int i = 0; i <= 1; i++) {
+      if (mitr->syms[i] == sym) {
+        out_index = i;
+      }
+    }
+    check(out_index >= 0, "market does not match");
+
+    asset quantity = asset(amount, sym.get_symbol());
+    check(quantity.amount > 0, "invalid amount");
+
+    asset st_reserve = mitr->reserves[out_index];
+    if (mitr->lendables[out_index]) {
+      st_reserve = _get_pzrate(mitr, out_index).cal_anchor_quantity(mitr->reserves[out_index]);
+    }
+    check(st_reserve > quantity, "insufficient reserve");
+
+    flashes.emplace(_self, [&](auto& row) {
+      row.lptoken = mitr->lptoken;
+      row.account = account;
+      row.out_index = out_index;
+      row.quantity = quantity;
+      row.repaids = {asset(0, mitr->syms[0].get_symbol()), asset(0, mitr->syms[1].get_symbol())};
+    });
+
+    if (mitr->lendables[out_index]) {
+      _lend_withdraw(sym.get_contract(), quantity);
+    }
+    _flush_lend();
+    _transfer_out(account, sym.get_contract(), quantity, "flash swap");
+
+    asset fee = asset((double)quantity.amount * decimal2double(mitr->config.fee_rate), quantity.symbol);
+    action(
+      permission_level{_self, name("active")},
+      account,
+      name("onflashswap"),
+      std::make_tuple(lpsym, quantity, fee)
+    ).send();
+
+    action(
+      permission_level{_self, name("active")},
+      _self,
+      name("flashsettle"),
+      std::make_tuple(lpsym)
+    ).send();
+  };
+
+  void pizzair::_flash_repay(symbol_code lpsym, name contract, asset quantity) {
+    auto fitr = flashes.require_find(lpsym.raw(), "no flash swap to repay");
+    market m = markets.get(lpsym.raw(), "market not found");
+
+    int index = -1;
+    for (int i = 0; i <= 1; i++) {
+      if (m.syms[i].get_contract() == contract && m.syms[i].get_symbol() == quantity.symbol) {
+        index = i;
+      }
+    }
+    check(index >= 0, "market does not match");
+
+    flashes.modify(fitr, _self, [&](auto& row) {
+      row.repaids[index] += quantity;
+    });
+  };
+
+  // the flash swap stands if the pool, after paying the admin fee, keeps at least the LP fee on top of its invariant
+  void pizzair::flashsettle(symbol_code lpsym) {
+    require_auth(_self);
+
+    auto fitr = flashes.require_find(lpsym.raw(), "no flash swap to settle");
+    auto mitr = markets.require_find(lpsym.raw(), "market not found");
+
+    int out_index = fitr->out_index;
+    int in_index = out_index == 0 ? 1 : 0;
+
+    std::vector<asset> reserves = mitr->reserves;
+    std::vector<asset> st_reserves = mitr->reserves;
+    pizzalend::pzrate pzs[2];
+    double pzprices[2] = {0, 0};
+    for (int i = 0; i <= 1; i++) {
+      if (mitr->lendables[i]) {
+        pzs[i] = _get_pzrate(mitr, i);
+        pzprices[i] = pzs[i].cal_pzprice();
+        st_reserves[i] = pzs[i].cal_anchor_quantity(reserves[i], pzprices[i]);
+      }
+    }
+
+    market_fee fee_conf = _get_fee_conf(mitr->lptoken);
+    asset quantity = fitr->quantity;
+    asset fee = asset((double)quantity.amount * decimal2double(mitr->config.fee_rate), quantity.symbol);
+    asset admin_fee = asset((double)fee.amount * (1 - decimal2double(fee_conf.lp_rate)), quantity.symbol);
+    asset lp_fee = fee - admin_fee;
+
+    std::vector<asset> repaids = fitr->repaids;
+    std::vector<asset> st_afters = st_reserves;
+    st_afters[in_index] += repaids[in_index];
+    st_afters[out_index] += repaids[out_index] - quantity - admin_fee;
+    check(st_afters[out_index] > lp_fee, "insufficient reserve");
+
+    double A = _get_exact_leverage(mitr);
+    double D = cal_D(A, asset2double(st_reserves[0]), asset2double(st_reserves[1]));
+    std::vector<asset> kept = st_afters;
+    kept[out_index] -= lp_fee;
+    check(cal_D(A, asset2double(kept[0]), asset2double(kept[1])) >= D, "flash swap is not repaid");
+
+    // repaid tokens are held by the contract, the loan came out of the pool
+    std::vector<asset> liquids = repaids;
+    liquids[out_index] -= admin_fee;
+    for (int i = 0; i <= 1; i++) {
+      if (!mitr->lendables[i]) {
+        reserves[i] = st_afters[i];
+        continue;
+      }
+
+      asset decr = i == out_index ? quantity : asset(0, quantity.symbol);
+      if (liquids[i].amount > 0) {
+        _lend_collateral(mitr->syms[i].get_contract(), liquids[i]);
+        reserves[i] += pzs[i].cal_pzquantity(liquids[i], pzprices[i]);
+      } else if (liquids[i].amount < 0) {
+        _lend_withdraw(mitr->syms[i].get_contract(), -liquids[i]);
+        decr -= liquids[i];
+      }
+      if (decr.amount > 0) {
+        asset pzdecr = pzs[i].cal_pzquantity(decr, pzprices[i]);
+        check(reserves[i] >= pzdecr, "insufficient reserve");
+        reserves[i] -= pzdecr;
+      }
+    }
+
+    _flush_lend();
+    if (admin_fee.amount > 0) {
+      _transfer_out(PLANB_CONTRACT, mitr->syms[out_index].get_contract(), admin_fee, "admin fee");
+    }
+
+    _log_swap(fitr->account, lpsym, repaids[in_index], quantity, fee);
+
+    _stat_swap(mitr, in_index, repaids[in_index], quantity, out_index, lp_fee, admin_fee, asset(0, quantity.symbol));
+
+    flashes.erase(fitr);
+
+    _update_market_reserve(mitr, st_afters, reserves, mitr->lpamount);
   };
 
   void pizzair::_on_lptoken_transfer(name from, name to, asset quantity, std::string memo) {
@@ -418,7 +1069,7 @@ namespace pizzair {
     _decr_liqdt(from, mitr, quantity.amount);
   };
 
-  void pizzair::_demand(name account, name contract, asset quantity, int sym_index) {
+  demand_result pizzair::_demand(name account, name contract, asset quantity, int sym_index) {
     _check_allow(account, FEATURE_DEMAND);
 
     check(contract == LPTOKEN_CONTRACT, "only lptoken can demand");
@@ -427,33 +1078,74 @@ namespace pizzair {
     auto mitr = markets.find(lpsym.raw());
     check(mitr != markets.end() && mitr->lptoken == quantity.symbol, "market not found");
     check(mitr->lpamount >= quantity.amount, "insufficient lpamount");
+    _check_not_flashing(lpsym);
+
+    demand_result result;
+    if (sym_index >= 0 && sym_index <= 1) {
+      result = _demand_single(account, mitr, quantity, sym_index);
+    } else {
+      result = _withdraw(mitr, quantity);
+      _log_demand(account, lpsym, quantity, result.gots);
+
+      _flush_lend();
+      for (int i = 0; i <= 1; i++) {
+        if (result.gots[i].amount > 0) {
+          _transfer_out(account, mitr->syms[i].get_contract(), result.gots[i], "demand");
+        }
+      }
+    }
+
+    _decr_liqdt(account, mitr, quantity.amount);
+
+    _retire_lptoken(quantity);
+
+    _stat_demand(mitr);
+
+    return result;
+  };
+
+  // pays the whole share out in one token: the share of the other side is swapped against
+  // the pool left after the proportional withdrawal and never leaves the contract
+  demand_result pizzair::_demand_single(name account, market_tlb::const_iterator mitr, asset quantity, int out_index) {
+    _check_allow(account, FEATURE_SWAP);
+
+    single_withdrawal withdrawal = _withdraw_single(mitr, quantity, out_index);
+    _log_demand(account, mitr->lptoken.code(), quantity, withdrawal.result.gots);
+
+    _flush_lend();
+    asset got = withdrawal.result.gots[out_index];
+    if (got.amount > 0) {
+      _transfer_out(account, mitr->syms[out_index].get_contract(), got, "demand");
+    }
+
+    if (withdrawal.admin_fee.quantity.amount > 0) {
+      _transfer_out(PLANB_CONTRACT, withdrawal.admin_fee.contract, withdrawal.admin_fee.quantity, "admin fee");
+    }
 
-    double ratio = (double)quantity.amount / mitr->lpamount;
+    return withdrawal.result;
+  };
 
+  // proportional withdrawal of an lp share booked on the market, nothing is paid out and lend movements are left in the ledger
+  demand_result pizzair::_withdraw(market_tlb::const_iterator mitr, asset quantity) {
     std::vector<asset> reserves = mitr->reserves;
 
     std::vector<asset> st_reserves = {asset(0, mitr->syms[0].get_symbol()), asset(0, mitr->syms[1].get_symbol())};
 
     std::vector<asset> gots;
     for (int i = 0; i <= 1; i++) {
-      int64_t amount = mitr->reserves[i].amount * ratio;
+      int64_t amount = withdraw_share(mitr->reserves[i].amount, quantity.amount, mitr->lpamount);
       asset got = asset(amount, reserves[i].symbol);
       check(reserves[i] >= got, "insufficient reserve");
       reserves[i] -= got;
 
       if (mitr->lendables[i]) {
-        pizzalend::pztoken pz = pizzalend::get_pztoken_byanchor(mitr->syms[i]);
+        pizzalend::pzrate pz = _get_pzrate(mitr, i);
         double pzprice = pz.cal_pzprice();
 
         st_reserves[i] = pz.cal_anchor_quantity(reserves[i], pzprice);
         if (got.amount > 0) {
-          action(
-            permission_level{_self, name("active")},
-            LEND_CONTRACT,
-            name("withdraw"),
-            std::make_tuple(_self, pz.pzsymbol.get_contract(), got)
-          ).send();
           got = pz.cal_anchor_quantity(got, pzprice);
+          _lend_withdraw(mitr->syms[i].get_contract(), got);
         } else {
           got = asset(0, pz.anchor.get_symbol());
         }
@@ -463,28 +1155,106 @@ namespace pizzair {
       gots.push_back(got);
     }
 
-    _log_demand(account, lpsym, quantity, gots);
+    _update_market_reserve(mitr, st_reserves, reserves, mitr->lpamount - quantity.amount);
 
-    _update_market_reserve(mitr, reserves, reserves, mitr->lpamount-quantity.amount);
+    return demand_result{quantity, gots, st_reserves};
+  };
 
-    _decr_liqdt(account, mitr, quantity.amount);
+  pizzair::single_withdrawal pizzair::_withdraw_single(market_tlb::const_iterator mitr, asset quantity, int out_index) {
+    int in_index = out_index == 0 ? 1 : 0;
 
-    _retire_lptoken(quantity);
-    
-    int swap_index = -1;
-    if (sym_index >= 0 && sym_index <= 1) {
-      swap_index = sym_index == 0 ? 1 : 0;
+    std::vector<asset> reserves = mitr->reserves;
+    std::vector<asset> st_reserves = mitr->reserves;
+    std::vector<asset> st_shares = {asset(0, mitr->syms[0].get_symbol()), asset(0, mitr->syms[1].get_symbol())};
+
+    pizzalend::pzrate pzs[2];
+    double pzprices[2] = {0, 0};
+    for (int i = 0; i <= 1; i++) {
+      asset share = asset(withdraw_share(reserves[i].amount, quantity.amount, mitr->lpamount), reserves[i].symbol);
+      check(reserves[i] >= share, "insufficient reserve");
+
+      if (mitr->lendables[i]) {
+        pzs[i] = _get_pzrate(mitr, i);
+        pzprices[i] = pzs[i].cal_pzprice();
+        st_reserves[i] = pzs[i].cal_anchor_quantity(reserves[i], pzprices[i]);
+        st_shares[i] = pzs[i].cal_anchor_quantity(share, pzprices[i]);
+      } else {
+        st_shares[i] = share;
+      }
     }
 
+    double fee_rate = decimal2double(mitr->config.fee_rate);
+    market_fee fee_conf = _get_fee_conf(mitr->lptoken);
+
+    asset fee = asset(0, mitr->syms[fee_conf.index].get_symbol());
+    asset admin_fee = asset(0, fee.symbol);
+
+    asset from_quantity = st_shares[in_index];
+    asset to_quantity = asset(0, mitr->syms[out_index].get_symbol());
+    if (from_quantity.amount > 0) {
+      // the other side of the share is swapped against the pool left after the proportional part
+      double A = _get_exact_leverage(mitr);
+      double x = asset2double(st_reserves[in_index] - st_shares[in_index]);
+      double y = asset2double(st_reserves[out_index] - st_shares[out_index]);
+      swap_quote quote = quote_swap(from_quantity.amount, A, x, y, from_quantity.symbol.precision(), to_quantity.symbol.precision(),
+                                    fee_rate, decimal2double(fee_conf.lp_rate), fee_conf.index == in_index);
+      to_quantity.amount = quote.got;
+      fee.amount = quote.fee;
+      admin_fee.amount = quote.admin_fee;
+
+      if (fee_rate > 0) {
+        check(admin_fee.amount > 0, "swap amount is too small");
+      }
+    }
+
+    asset got = st_shares[out_index] + to_quantity;
+    std::vector<asset> gots = {asset(0, mitr->syms[0].get_symbol()), asset(0, mitr->syms[1].get_symbol())};
+    gots[out_index] = got;
+
+    // only the payout and the admin fee leave the pool
+    std::vector<asset> st_decrs = {asset(0, mitr->syms[0].get_symbol()), asset(0, mitr->syms[1].get_symbol())};
+    st_decrs[out_index] += got;
+    st_decrs[fee_conf.index] += admin_fee;
+
     for (int i = 0; i <= 1; i++) {
-      if (gots[i].amount > 0) {
-        if (swap_index == i) {
-          _swap(mitr->lptoken.code(), account, mitr->syms[i].get_contract(), gots[i]);
-        } else {
-          _transfer_out(account, mitr->syms[i].get_contract(), gots[i], "demand");
-        }
+      if (st_decrs[i].amount == 0) continue;
+      check(st_reserves[i] >= st_decrs[i], "insufficient reserve");
+
+      if (mitr->lendables[i]) {
+        _lend_withdraw(mitr->syms[i].get_contract(), st_decrs[i]);
+        asset decr = pzs[i].cal_pzquantity(st_decrs[i], pzprices[i]);
+        check(reserves[i] >= decr, "insufficient reserve");
+        reserves[i] -= decr;
+      } else {
+        reserves[i] -= st_decrs[i];
       }
+      st_reserves[i] -= st_decrs[i];
     }
+
+    asset zero_fee = asset(0, fee.symbol);
+    _stat_swap(mitr, in_index, st_shares[in_index], to_quantity, fee_conf.index, fee - admin_fee, admin_fee, zero_fee);
+
+    _update_market_reserve(mitr, st_reserves, reserves, mitr->lpamount - quantity.amount);
+
+    extended_asset admin = extended_asset(admin_fee, mitr->syms[fee_conf.index].get_contract());
+    return single_withdrawal{demand_result{quantity, gots, st_reserves}, admin};
+  };
+
+  void pizzair::_flush_lend() {
+    for (auto& move : lend_moves) {
+      asset quantity = asset(move.amount, move.sym.get_symbol());
+      if (quantity.amount > 0) {
+        _transfer_out(LEND_CONTRACT, move.sym.get_contract(), quantity, "collateral");
+      } else if (quantity.amount < 0) {
+        action(
+          permission_level{_self, name("active")},
+          LEND_CONTRACT,
+          name("withdraw"),
+          std::make_tuple(_self, move.sym.get_contract(), -quantity)
+        ).send();
+      }
+    }
+    lend_moves.clear();
   };
 
   void pizzair::_transfer_out(name to, name contract, asset quantity, std::string memo) {
@@ -502,8 +1272,8 @@ namespace pizzair {
     double p = std::min(r0, r1) * pow(10, -6);
     double price0 = 0;
     double price1 = 0;
+    double A = _get_exact_leverage(mitr);
     if (p > 0) {
-      double A = _get_exact_leverage(mitr);
       price0 = p_to_q(p, A, r0, r1) / p;
       price1 = p_to_q(p, A, r1, r0) / p;
     }
@@ -517,6 +1287,19 @@ namespace pizzair {
     });
 
     _log_upmarket(mitr->lptoken.code(), st_reserves, mitr->prices, mitr->lpamount);
+
+    _snapshot_market(mitr, st_reserves, A);
+  };
+
+  // reprices a market and rewrites its snapshot after a config change, reserves stay as they are
+  void pizzair::_refresh_market(market_tlb::const_iterator mitr) {
+    std::vector<asset> st_reserves = mitr->reserves;
+    for (int i = 0; i <= 1; i++) {
+      if (mitr->lendables[i]) {
+        st_reserves[i] = _get_pzrate(mitr, i).cal_anchor_quantity(mitr->reserves[i]);
+      }
+    }
+    _update_market_reserve(mitr, st_reserves, mitr->reserves, mitr->lpamount);
   };
 
   void pizzair::addpool(symbol_code psym, uint8_t decimals) {
@@ -528,17 +1311,18 @@ namespace pizzair {
     pools.emplace(_self, [&](auto& row) {
       row.psym = psym;
       row.decimals = decimals;
+      row.last_id.emplace(0);
     });
   };
 
   void pizzair::addmarket(symbol_code psym, extended_symbol sym0, extended_symbol sym1, market_config config) {
     require_auth(permission_level{ADMIN_ACCOUNT, name("manager")});
 
-    pool p = pools.get(psym.raw(), "pool not found");
+    auto pitr = pools.require_find(psym.raw(), "pool not found");
     auto itr = _find_market(sym0, sym1);
     check(itr == markets.end(), "market already exists");
 
-    symbol sym = _next_lptoken(p);
+    symbol sym = _next_lptoken(pitr);
     _create_lptoken(asset(LPSYM_MAX_SUPPLY * pow(10, sym.precision()), sym));
     
     markets.emplace(_self, [&](auto& row) {
@@ -549,7 +1333,11 @@ namespace pizzair {
       row.lendables = {0, 0};
       row.lpamount = 0;
       row.config = config;
+      row.set_ramp(market_ramp{config.leverage, 0, 0});
     });
+
+    _log_addmarket(sym, sym0, sym1);
+    _log_upconfig(sym.code(), config);
   };
 
   void pizzair::setmarket(symbol_code lpsym, market_config config) {
@@ -557,9 +1345,20 @@ namespace pizzair {
 
     auto itr = markets.find(lpsym.raw());
     check(itr != markets.end(), "market not found");
+    // a new config takes effect at once, any running ramp is dropped
     markets.modify(itr, _self, [&](auto& row) {
       row.config = config;
+      row.set_ramp(market_ramp{config.leverage, 0, 0});
     });
+
+    auto litr = mleverages.find(lpsym.raw());
+    if (litr != mleverages.end()) {
+      mleverages.erase(litr);
+    }
+
+    _log_upconfig(lpsym, config);
+
+    _refresh_market(itr);
   };
 
   void pizzair::setlendable(symbol_code lpsym, extended_symbol sym, bool lendable) {
@@ -574,7 +1373,8 @@ namespace pizzair {
         }
       }
       check(index >= 0, "market does not match");
-      return _setlendable(mitr, index, lendable);
+      _setlendable(mitr, index, lendable);
+      return _flush_lend();
     }
 
     for (auto itr = markets.begin(); itr != markets.end(); itr++) {
@@ -584,6 +1384,36 @@ namespace pizzair {
         }
       }
     }
+    _flush_lend();
+  };
+
+  symbol_code pizzair::setlendables(extended_symbol sym, bool lendable, symbol_code cursor, uint32_t max_rows) {
+    require_auth(permission_level{ADMIN_ACCOUNT, name("manager")});
+
+    check(max_rows > 0, "max rows should be positive");
+
+    name job = name("setlendable");
+    if (!cursor.raw()) {
+      auto jitr = bulkjobs.find(job.value);
+      if (jitr != bulkjobs.end() && jitr->sym == sym && jitr->flag == lendable) {
+        cursor = jitr->cursor;
+      }
+    }
+
+    auto itr = markets.lower_bound(cursor.raw());
+    for (uint32_t rows = 0; itr != markets.end() && rows < max_rows; itr++, rows++) {
+      for (auto i = 0; i < 2; i++) {
+        if (itr->syms[i] == sym) {
+          _setlendable(itr, i, lendable);
+        }
+      }
+    }
+
+    _flush_lend();
+
+    symbol_code next = itr == markets.end() ? symbol_code() : itr->lptoken.code();
+    _save_bulkjob(job, sym, lendable, next);
+    return next;
   };
 
   void pizzair::setleverage(symbol_code lpsym, uint32_t leverage, uint32_t effective_secs) {
@@ -593,24 +1423,52 @@ namespace pizzair {
     uint32_t current_leverage = _get_leverage(mitr);
 
     auto litr = mleverages.find(lpsym.raw());
-    if (litr == mleverages.end()) {
-      mleverages.emplace(_self, [&](auto& row) {
-        row.lptoken = mitr->lptoken;
-        row.leverage = leverage;
-        row.begined_at = current_secs();
-        row.effective_secs = effective_secs;
-      });
-    } else {
-      markets.modify(mitr, _self, [&](auto& row) {
-        row.config.leverage = current_leverage;
-      });
+    if (litr != mleverages.end()) {
+      mleverages.erase(litr);
+    }
 
-      mleverages.modify(litr, _self, [&](auto& row) {
-        row.leverage = leverage;
-        row.begined_at = current_secs();
-        row.effective_secs = effective_secs;
-      });
+    markets.modify(mitr, _self, [&](auto& row) {
+      row.config.leverage = leverage;
+      row.set_ramp(market_ramp{current_leverage, current_secs(), effective_secs});
+    });
+
+    _log_upleverage(lpsym, current_leverage, leverage, current_secs(), effective_secs);
+
+    _refresh_market(mitr);
+  };
+
+  void pizzair::syncramp(symbol_code lpsym) {
+    require_auth(permission_level{ADMIN_ACCOUNT, name("manager")});
+
+    auto mitr = markets.require_find(lpsym.raw(), "market not found");
+
+    uint32_t target = _scale_leverage(mitr->config.leverage);
+    market_ramp ramp = {target, 0, 0};
+    if (mitr->ramp.has_value()) {
+      ramp = mitr->ramp.value();
+    }
+
+    auto litr = mleverages.find(lpsym.raw());
+    if (litr != mleverages.end()) {
+      ramp = {target, litr->begined_at, litr->effective_secs};
+      target = _scale_leverage(litr->leverage);
+      mleverages.erase(litr);
     }
+
+    if (current_secs() - ramp.begined_at >= ramp.effective_secs) {
+      ramp = {target, 0, 0};
+    }
+    ramp.from = _scale_leverage(ramp.from);
+
+    markets.modify(mitr, _self, [&](auto& row) {
+      row.config.leverage = target;
+      row.set_ramp(ramp);
+    });
+
+    // leverage may have been rescaled or its ramp finished, followers must see the result
+    _log_upleverage(lpsym, ramp.from, target, ramp.begined_at, ramp.effective_secs);
+
+    _refresh_market(mitr);
   };
 
   void pizzair::setfee(symbol_code lpsym, decimal lp_rate, int index) {
@@ -635,6 +1493,8 @@ namespace pizzair {
         row.index = index;
       });
     }
+
+    _log_upfee(lpsym, lp_rate, index);
   };
 
   void pizzair::addallow(name account, name feature, uint32_t duration) {
@@ -702,7 +1562,7 @@ namespace pizzair {
     if (ori_lendable == lendable) return;
 
     extended_symbol sym = mitr->syms[index];
-    pizzalend::pztoken pz = pizzalend::get_pztoken_byanchor(sym);
+    pizzalend::pzrate pz = _get_pzrate(mitr, index);
     double pzprice = pz.cal_pzprice();
     
     if (lendable) {
@@ -711,7 +1571,7 @@ namespace pizzair {
       if (quantity.amount > 0) {
         pzquantity = pz.cal_pzquantity(quantity, pzprice);
 
-        _transfer_out(LEND_CONTRACT, sym.get_contract(), quantity, "collateral");
+        _lend_collateral(sym.get_contract(), quantity);
       }
 
       markets.modify(mitr, _self, [&](auto& row) {
@@ -724,12 +1584,7 @@ namespace pizzair {
       if (pzquantity.amount > 0) {
         quantity = pz.cal_anchor_quantity(pzquantity, pzprice);
 
-        action(
-          permission_level{_self, name("active")},
-          LEND_CONTRACT,
-          name("withdraw"),
-          std::make_tuple(_self, pz.pzsymbol.get_contract(), pzquantity)
-        ).send();
+        _lend_withdraw(pz.pzsymbol.get_contract(), pzquantity);
       }
 
       markets.modify(mitr, _self, [&](auto& row) {
@@ -739,27 +1594,35 @@ namespace pizzair {
     }
   };
 
-  symbol pizzair::_next_lptoken(pool p) {
-    auto markets_bypsym = markets.get_index<name("bypsym")>();
-    uint64_t next_id = 1;
-    auto itr = markets_bypsym.lower_bound(p.psym.raw());
+  symbol pizzair::_next_lptoken(pool_tlb::const_iterator pitr) {
+    std::string prefix = pitr->psym.to_string();
 
-    int last_num = 0;
-    while (itr != markets_bypsym.end() && itr->psym() == p.psym) {
-      std::string roman = itr->lptoken.code().to_string().substr(p.psym.to_string().size());
-      int num = roman_to_int(roman);
-      if (num > last_num) {
-        last_num = num;
+    uint32_t last_id = 0;
+    if (pitr->last_id.has_value()) {
+      last_id = pitr->last_id.value();
+    } else {
+      // pools created before the counter only hold roman suffixes, scan them once
+      auto markets_bypsym = markets.get_index<name("bypsym")>();
+      auto itr = markets_bypsym.lower_bound(pitr->psym.raw());
+      while (itr != markets_bypsym.end() && itr->psym() == pitr->psym) {
+        std::string roman = itr->lptoken.code().to_string().substr(prefix.size());
+        uint32_t num = roman_to_int(roman);
+        if (num > last_id) {
+          last_id = num;
+        }
+        itr++;
       }
-      itr++;
     }
-    next_id = last_num + 1;
-    std::string next_roman = int_to_roman(next_id);
-    symbol_code next_code = symbol_code(p.psym.to_string() + next_roman);
-    return symbol(next_code, p.decimals);
-  };
 
-  
+    uint32_t next_id = last_id + 1;
+    pools.modify(pitr, _self, [&](auto& row) {
+      row.last_id.emplace(next_id);
+    });
+
+    std::string suffix = int_to_lpsuffix(next_id, 7 - prefix.size());
+    symbol_code next_code = symbol_code(prefix + suffix);
+    return symbol(next_code, pitr->decimals);
+  };
 
   #ifndef MAINNET
     void pizzair::clear() {
@@ -772,6 +1635,12 @@ namespace pizzair {
 
       auto litr = liqdts.begin();
       while (litr != liqdts.end()) litr = liqdts.erase(litr);
+
+      auto sitr = mstats.begin();
+      while (sitr != mstats.end()) sitr = mstats.erase(sitr);
+
+      auto nitr = msnapshots.begin();
+      while (nitr != msnapshots.end()) nitr = msnapshots.erase(nitr);
     };
   #endif
 }
\ No newline at end of file
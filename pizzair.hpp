@@ -1,6 +1,8 @@
 #include "common.hpp"
 #include "memo.hpp"
 #include "pizzalend.hpp"
+#include "curve.hpp"
+#include "snapshot.hpp"
 
 #define PSYM_LEN 3
 
@@ -10,6 +12,10 @@
 
 #define LEVERAGE_DECIMALS 4
 
+#define ORDER_EXPIRE_SECS 604800
+
+#define BATCH_MAX_INTENTS 200
+
 #ifdef MAINNET
   #define LPTOKEN_CONTRACT name("lptoken.air")
   #define PREMIUM_ACCOUNT name("income.air")
@@ -31,23 +37,12 @@
 #define ALL name("all")
 
 namespace pizzair {
-  double p_to_q(double p, double A, double x, double y) {
-    double n = 4*(4*A - 1)*x*y;
-    double m = -16*A*x*y*(x+y);
-    double t = sqrt(pow(m/2, 2)+pow(n/3, 3));
-    double D = cbrt(-m/2 + t) + cbrt(-m/2 - t);
-    double G = 4*A*(x+y+p-D) + D;
-    double c = 4*y*G - pow(D, 3)/(x+p);
-    double a = 16*A;
-    double b = -(4*G + 16*A*y);
-    double delta = pow(b, 2) - 4*a*c;
-    double q = (-b - sqrt(delta)) / (2*a);
-    return q;
-  };
-
-  double cal_price(double A, double x, double y) {
-    double p = std::min(x, y) * pow(10, -6);
-    return p_to_q(p, A, x, y) / p;
+  // input amount an exact-input _swap needs to pay out at least `out`
+  int64_t cal_exact_in(int64_t out, double A, double x, double y, uint8_t in_precision, uint8_t out_precision, double fee_rate, bool fee_on_in) {
+    int64_t amount = exact_in(out, A, x, y, in_precision, out_precision, fee_rate, fee_on_in);
+    check(amount >= 0, "insufficient reserve");
+    check(amount > 0, "failed to solve the exact output");
+    return amount;
   };
 
   struct market_config {
@@ -55,12 +50,53 @@ namespace pizzair {
     decimal fee_rate;
   };
 
+  // results returned by the swap, supply and demand actions, reserves are anchor-denominated and post-trade
+  struct swap_result {
+    asset paid;
+    asset got;
+    asset fee;
+    std::vector<asset> reserves;
+  };
+
+  struct supply_result {
+    std::vector<asset> deposits;
+    asset lpquantity;
+    std::vector<asset> reserves;
+  };
+
+  struct demand_result {
+    asset lpquantity;
+    std::vector<asset> gots;
+    std::vector<asset> reserves;
+  };
+
+  // an account's share of a market, redeemables are what a proportional demand would pay now
+  struct position {
+    asset lpquantity;
+    std::vector<asset> redeemables;
+    std::vector<asset> principals;
+  };
+
+  struct positions_result {
+    std::vector<position> positions;
+    symbol_code next;
+  };
+
+  // one page of exportstate, data is a run of snapshot records and next is 0 once the table is done
+  struct export_page {
+    uint16_t version;
+    uint8_t section;
+    uint64_t next;
+    std::vector<char> data;
+  };
+
   class [[eosio::contract]] pizzair : public contract {
   public:
     pizzair(name self, name first_receiver, datastream<const char*> ds) :
       contract(self, first_receiver, ds), pools(self, self.value), 
       markets(self, self.value), liqdts(self, self.value), mleverages(self, self.value), 
-      mfees(self, self.value), invitations(self, self.value), minsupplies(self, self.value) {}
+      mfees(self, self.value), mstats(self, self.value), invitations(self, self.value), minsupplies(self, self.value),
+      bulkjobs(self, self.value), msnapshots(self, self.value), flashes(self, self.value) {}
 
     [[eosio::on_notify("*::transfer")]]
     void on_transfer(name from, name to, asset quantity, std::string memo);
@@ -77,9 +113,24 @@ namespace pizzair {
     [[eosio::action]]
     void setlendable(symbol_code lpsym, extended_symbol sym, bool lendable);
 
+    [[eosio::action]]
+    symbol_code setlendables(extended_symbol sym, bool lendable, symbol_code cursor, uint32_t max_rows);
+
     [[eosio::action]]
     void setleverage(symbol_code lpsym, uint32_t leverage, uint32_t effective_secs);
 
+    [[eosio::action]]
+    void syncramp(symbol_code lpsym);
+
+    [[eosio::action]]
+    void setbatch(symbol_code lpsym, uint32_t window_secs);
+
+    [[eosio::action]]
+    void settlebatch(symbol_code lpsym, uint32_t max_rows);
+
+    [[eosio::action]]
+    void cancelintent(name account, symbol_code lpsym, uint64_t id);
+
     [[eosio::action]]
     void setfee(symbol_code lpsym, decimal lp_rate, int index);
 
@@ -93,7 +144,37 @@ namespace pizzair {
     void remallow(name account, name feature);
 
     [[eosio::action]]
-    void supply(name account, symbol_code lpsym);
+    supply_result supply(name account, symbol_code lpsym);
+
+    [[eosio::action]]
+    swap_result swap(name account, symbol_code lpsym, extended_symbol sym, uint64_t expect, uint32_t slippage, name invite_code);
+
+    [[eosio::action]]
+    demand_result demand(name account, asset quantity, int sym_index);
+
+    [[eosio::action]]
+    positions_result positions(name account, symbol_code cursor, uint32_t max_rows);
+
+    [[eosio::action]]
+    export_page exportstate(uint8_t section, uint64_t cursor, uint32_t max_rows);
+
+    [[eosio::action]]
+    void flashswap(name account, symbol_code lpsym, extended_symbol sym, uint64_t amount);
+
+    [[eosio::action]]
+    void flashsettle(symbol_code lpsym);
+
+    [[eosio::action]]
+    void cancelorder(name account, symbol_code lpsym);
+
+    [[eosio::action]]
+    void sweeporders(symbol_code lpsym, uint32_t max_rows, std::vector<name> skips);
+
+    [[eosio::action]]
+    name sweeplegacy(symbol_code lpsym, name cursor, uint32_t max_rows, std::vector<name> skips);
+
+    [[eosio::action]]
+    void claim(name account, extended_symbol sym);
 
     [[eosio::action]]
     void setinvite(name code, name account, decimal fee_rate);
@@ -142,9 +223,39 @@ namespace pizzair {
       _log(name("upliqdt"), args);
     };
 
+    std::string _sym_to_string(extended_symbol sym) {
+      return std::to_string(sym.get_symbol().precision()) + "," + sym.get_symbol().code().to_string() + "@" + sym.get_contract().to_string();
+    };
+
+    void _log_addmarket(symbol lptoken, extended_symbol sym0, extended_symbol sym1) {
+      std::vector<std::string> args = {lptoken.code().to_string(), std::to_string(lptoken.precision()), _sym_to_string(sym0), _sym_to_string(sym1)};
+      _log(name("addmarket"), args);
+    };
+
+    void _log_upconfig(symbol_code lpsym, market_config config) {
+      std::vector<std::string> args = {lpsym.to_string(), std::to_string(config.leverage), config.fee_rate.to_string()};
+      _log(name("upconfig"), args);
+    };
+
+    void _log_upleverage(symbol_code lpsym, uint32_t from, uint32_t to, uint32_t begined_at, uint32_t effective_secs) {
+      std::vector<std::string> args = {lpsym.to_string(), std::to_string(from), std::to_string(to), std::to_string(begined_at), std::to_string(effective_secs)};
+      _log(name("upleverage"), args);
+    };
+
+    void _log_batch(symbol_code lpsym, uint32_t count, double price) {
+      std::vector<std::string> args = {lpsym.to_string(), std::to_string(count), std::to_string(price)};
+      _log(name("batch"), args);
+    };
+
+    void _log_upfee(symbol_code lpsym, decimal lp_rate, int index) {
+      std::vector<std::string> args = {lpsym.to_string(), lp_rate.to_string(), std::to_string(index)};
+      _log(name("upfee"), args);
+    };
+
     struct [[eosio::table]] pool {
       symbol_code psym;
       uint8_t decimals;
+      binary_extension<uint32_t> last_id;
 
       uint64_t primary_key() const {
         return psym.raw();
@@ -154,7 +265,7 @@ namespace pizzair {
     typedef eosio::multi_index<name("pool"), pool> pool_tlb;
     pool_tlb pools;
 
-    symbol _next_lptoken(pool p);
+    symbol _next_lptoken(pool_tlb::const_iterator pitr);
 
     struct [[eosio::table]] minsupply {
       symbol_code psym;
@@ -191,6 +302,21 @@ namespace pizzair {
     typedef eosio::multi_index<name("mleverage"), market_leverage> mleverage_tlb;
     mleverage_tlb mleverages;
 
+    // leverage ramp of a market, config.leverage holds the target
+    struct market_ramp {
+      uint32_t from;
+      uint32_t begined_at;
+      uint32_t effective_secs;
+    };
+
+    // a market's ramp resolved for readers, leverages carry LEVERAGE_DECIMALS
+    struct leverage_ramp {
+      uint32_t from;
+      uint32_t target;
+      uint32_t begined_at;
+      uint32_t effective_secs;
+    };
+
     struct [[eosio::table]] market {
       symbol lptoken;
       std::vector<extended_symbol> syms;
@@ -199,11 +325,25 @@ namespace pizzair {
       std::vector<uint8_t> lendables;
       uint64_t lpamount;
       market_config config;
+      binary_extension<std::vector<name>> pznames;
+      binary_extension<market_ramp> ramp;
+      binary_extension<uint32_t> batch_secs; // swaps are queued and cleared together, 0 swaps at once
 
       uint64_t primary_key() const {
         return lptoken.code().raw();
       }
 
+      bool is_batched() const {
+        return batch_secs.has_value() && batch_secs.value() > 0;
+      }
+
+      void set_ramp(market_ramp r) {
+        if (!pznames.has_value()) {
+          pznames.emplace(std::vector<name>{name(), name()});
+        }
+        ramp.emplace(r);
+      }
+
       symbol_code psym() const {
         return symbol_code(lptoken.code().to_string().substr(0, PSYM_LEN));
       };
@@ -247,47 +387,98 @@ namespace pizzair {
     };
 
     void _update_market_reserve(market_tlb::const_iterator mitr, std::vector<asset> st_reserves, std::vector<asset> reserves, uint64_t lpamount);
+    void _refresh_market(market_tlb::const_iterator mitr);
 
-    uint32_t _get_leverage(market_tlb::const_iterator mitr) {
-      int leverage_precision = pow(10, LEVERAGE_DECIMALS);
+    // denormalized view of a market for readers: anchor reserves, effective A and prices as of the last update
+    struct [[eosio::table]] market_snapshot {
+      symbol lptoken;
+      std::vector<extended_symbol> syms;
+      std::vector<asset> reserves;
+      std::vector<double> prices;
+      double leverage;
+      decimal fee_rate;
+      uint64_t lpamount;
+      uint64_t updated_at;
+      binary_extension<leverage_ramp> ramp;
 
-      if (mitr->config.leverage < leverage_precision/100) {
-        markets.modify(mitr, _self, [&](auto& row) {
-          row.config.leverage *= leverage_precision;
-        });
+      uint64_t primary_key() const {
+        return lptoken.code().raw();
       }
+    };
+    typedef eosio::multi_index<name("msnapshot"), market_snapshot> msnapshot_tlb;
+    msnapshot_tlb msnapshots;
+
+    void _snapshot_market(market_tlb::const_iterator mitr, const std::vector<asset>& st_reserves, double A) {
+      auto write = [&](auto& row) {
+        row.lptoken = mitr->lptoken;
+        row.syms = mitr->syms;
+        row.reserves = st_reserves;
+        row.prices = mitr->prices;
+        row.leverage = A;
+        row.fee_rate = mitr->config.fee_rate;
+        row.lpamount = mitr->lpamount;
+        row.updated_at = current_millis();
+        row.ramp.emplace(_get_ramp(mitr));
+      };
 
-      auto litr = mleverages.find(mitr->lptoken.code().raw());
-      if (litr == mleverages.end()) return mitr->config.leverage;
+      auto itr = msnapshots.find(mitr->lptoken.code().raw());
+      if (itr == msnapshots.end()) {
+        msnapshots.emplace(_self, write);
+      } else {
+        msnapshots.modify(itr, _self, write);
+      }
+    };
 
-      if (litr->leverage < leverage_precision/100) {
-        mleverages.modify(litr, _self, [&](auto& row) {
-          row.leverage *= leverage_precision;
-        });
+    // resolves the pztoken of a lendable side through byanchor only once, then reads it by primary key
+    pizzalend::pzrate _get_pzrate(market_tlb::const_iterator mitr, int index) {
+      if (mitr->pznames.has_value() && mitr->pznames.value()[index] != name()) {
+        return pizzalend::get_pzrate(mitr->pznames.value()[index]);
       }
-      
-      uint32_t passed_secs = current_secs() - litr->begined_at;
-      print_f("passed secs: %, effective secs: %, ", passed_secs, litr->effective_secs);
-      if (passed_secs >= litr->effective_secs) {
-        uint32_t leverage = litr->leverage;
-        markets.modify(mitr, _self, [&](auto& row) {
-          row.config.leverage = leverage;
-        });
-        mleverages.erase(litr);
-        return leverage;
+
+      name pzname = pizzalend::find_pzname_byanchor(mitr->syms[index]);
+      markets.modify(mitr, _self, [&](auto& row) {
+        if (!row.pznames.has_value()) {
+          row.pznames.emplace(std::vector<name>{name(), name()});
+        }
+        row.pznames.value()[index] = pzname;
+      });
+      return pizzalend::get_pzrate(pzname);
+    };
+
+    // legacy rows kept leverage without decimals
+    static uint32_t _scale_leverage(uint32_t leverage) {
+      uint32_t leverage_precision = pow(10, LEVERAGE_DECIMALS);
+      return leverage < leverage_precision/100 ? leverage * leverage_precision : leverage;
+    };
+
+    static uint32_t _ramp_leverage(uint32_t from, uint32_t to, uint32_t begined_at, uint32_t effective_secs) {
+      return ramp_leverage(from, to, current_secs() - begined_at, effective_secs);
+    };
+
+    // same as _get_pzrate without caching the pzname, for paths that must not write
+    pizzalend::pzrate _peek_pzrate(market_tlb::const_iterator mitr, int index) {
+      if (mitr->pznames.has_value() && mitr->pznames.value()[index] != name()) {
+        return pizzalend::get_pzrate(mitr->pznames.value()[index]);
+      }
+      return pizzalend::get_pzrate(pizzalend::find_pzname_byanchor(mitr->syms[index]));
+    };
+
+    leverage_ramp _get_ramp(market_tlb::const_iterator mitr) {
+      uint32_t leverage = _scale_leverage(mitr->config.leverage);
+      if (mitr->ramp.has_value()) {
+        const market_ramp& ramp = mitr->ramp.value();
+        return leverage_ramp{_scale_leverage(ramp.from), leverage, ramp.begined_at, ramp.effective_secs};
       }
 
-      int32_t a1 = mitr->config.leverage;
-      int32_t a2 = litr->leverage;
-      int32_t diff = a2 - a1;
-      double t = passed_secs;
-      double T = litr->effective_secs;
-      double rate = t/T;
+      auto litr = mleverages.find(mitr->lptoken.code().raw());
+      if (litr == mleverages.end()) return leverage_ramp{leverage, leverage, 0, 0};
+      return leverage_ramp{leverage, _scale_leverage(litr->leverage), litr->begined_at, litr->effective_secs};
+    };
 
-      print_f("a1: %, a2: %, diff: %, ", a1, a2, diff);
-      int32_t A = a1 + diff*rate;
-      print_f("A: %", A);
-      return A;
+    // read only, finishing ramps and migrating legacy rows is left to syncramp
+    uint32_t _get_leverage(market_tlb::const_iterator mitr) {
+      leverage_ramp ramp = _get_ramp(mitr);
+      return _ramp_leverage(ramp.from, ramp.target, ramp.begined_at, ramp.effective_secs);
     };
 
     double _get_exact_leverage(market_tlb::const_iterator mitr) {
@@ -321,15 +512,136 @@ namespace pizzair {
       return *itr;
     };
 
+    struct [[eosio::table]] market_stat {
+      symbol lptoken;
+      std::vector<asset> volumes;
+      std::vector<asset> lp_fees;
+      std::vector<asset> admin_fees;
+      std::vector<asset> invite_fees;
+      uint64_t swap_count;
+      uint64_t supply_count;
+      uint64_t demand_count;
+      uint64_t traded_at;
+
+      uint64_t primary_key() const {
+        return lptoken.code().raw();
+      }
+    };
+    typedef eosio::multi_index<name("mstat"), market_stat> mstat_tlb;
+    mstat_tlb mstats;
+
+    mstat_tlb::const_iterator _get_stat(market_tlb::const_iterator mitr) {
+      auto itr = mstats.find(mitr->lptoken.code().raw());
+      if (itr != mstats.end()) return itr;
+
+      std::vector<asset> zeros = {asset(0, mitr->syms[0].get_symbol()), asset(0, mitr->syms[1].get_symbol())};
+      return mstats.emplace(_self, [&](auto& row) {
+        row.lptoken = mitr->lptoken;
+        row.volumes = zeros;
+        row.lp_fees = zeros;
+        row.admin_fees = zeros;
+        row.invite_fees = zeros;
+        row.swap_count = 0;
+        row.supply_count = 0;
+        row.demand_count = 0;
+        row.traded_at = 0;
+      });
+    };
+
+    // volumes are accumulated per token: what the trader paid in on one side and got out on the other
+    // swaps is the number of trades folded into one call, settlebatch books each side at once
+    void _stat_swap(market_tlb::const_iterator mitr, int in_index, asset paid, asset got, int fee_index, asset lp_fee, asset admin_fee, asset invite_fee, uint32_t swaps = 1) {
+      int out_index = in_index == 0 ? 1 : 0;
+      mstats.modify(_get_stat(mitr), _self, [&](auto& row) {
+        row.volumes[in_index] += paid;
+        row.volumes[out_index] += got;
+        row.lp_fees[fee_index] += lp_fee;
+        row.admin_fees[fee_index] += admin_fee;
+        row.invite_fees[fee_index] += invite_fee;
+        row.swap_count += swaps;
+        row.traded_at = current_millis();
+      });
+    };
+
+    void _stat_supply(market_tlb::const_iterator mitr) {
+      mstats.modify(_get_stat(mitr), _self, [&](auto& row) {
+        row.supply_count += 1;
+      });
+    };
+
+    void _stat_demand(market_tlb::const_iterator mitr) {
+      mstats.modify(_get_stat(mitr), _self, [&](auto& row) {
+        row.demand_count += 1;
+      });
+    };
+
     struct [[eosio::table]] order {
       name account;
       std::vector<asset> reserves;
+      binary_extension<asset> lpquantity;
+      binary_extension<uint32_t> created_at;
 
       uint64_t primary_key() const {
         return account.value;
       }
+
+      // orders deposited before stamping have no created_at and are not in this index
+      uint64_t by_created() const {
+        return created_at.value_or(0);
+      }
+
+      bool has_lpquantity() const {
+        return lpquantity.has_value() && lpquantity.value().amount > 0;
+      }
+    };
+    typedef eosio::multi_index<
+      name("order"), order,
+      indexed_by<name("bycreated"), const_mem_fun<order, uint64_t, &order::by_created>>
+    > order_tlb;
+
+    // balances owed to an account but not pushed to it, withdrawn with the claim action.
+    // used where one account refusing a transfer must not block an action run for many accounts
+    struct [[eosio::table]] claimable {
+      uint64_t id;
+      extended_asset balance;
+
+      uint64_t primary_key() const { return id; }
+
+      uint128_t by_extsym() const {
+        return (uint128_t)balance.contract.value << 64 | balance.quantity.symbol.raw();
+      }
+    };
+    typedef eosio::multi_index<
+      name("claimable"), claimable,
+      indexed_by<name("byextsym"), const_mem_fun<claimable, uint128_t, &claimable::by_extsym>>
+    > claimable_tlb;
+
+    void _credit(name account, name contract, asset quantity) {
+      claimable_tlb claimables(_self, account.value);
+      auto claimables_byextsym = claimables.get_index<name("byextsym")>();
+      auto itr = claimables_byextsym.find((uint128_t)contract.value << 64 | quantity.symbol.raw());
+      if (itr == claimables_byextsym.end()) {
+        claimables.emplace(_self, [&](auto& row) {
+          row.id = claimables.available_primary_key();
+          row.balance = extended_asset(quantity, contract);
+        });
+      } else {
+        claimables_byextsym.modify(itr, _self, [&](auto& row) {
+          row.balance.quantity += quantity;
+        });
+      }
+    };
+
+    void _refund_order(const market& m, const order& o) {
+      for (int i = 0; i <= 1; i++) {
+        if (o.reserves[i].amount > 0) {
+          _transfer_out(o.account, m.syms[i].get_contract(), o.reserves[i], "refund");
+        }
+      }
+      if (o.has_lpquantity()) {
+        _transfer_out(o.account, LPTOKEN_CONTRACT, o.lpquantity.value(), "refund");
+      }
     };
-    typedef eosio::multi_index<name("order"), order> order_tlb;
 
     struct [[eosio::table]] liqdt {
       uint64_t id;
@@ -436,14 +748,66 @@ namespace pizzair {
 
     void _retire_lptoken(asset quantity);
 
-    void _swap(symbol_code lpsym, name account, name contract, asset quantity, uint64_t expect = 0, uint32_t slippage = 0, invitation ivt = invitation());
+    swap_result _swap(symbol_code lpsym, name account, name contract, asset quantity, uint64_t expect = 0, uint32_t slippage = 0, invitation ivt = invitation(), uint64_t exact_out = 0);
 
-    void _demand(name account, name contract, asset quantity, int sym_index = -1);
+    // swap body specialized on which sides are lendable, so plain markets skip every pz branch
+    template<bool in_lendable, bool out_lendable>
+    swap_result _swap_kernel(market_tlb::const_iterator mitr, int in_index, name account, name contract, asset quantity, uint64_t expect, uint32_t slippage, invitation ivt, uint64_t exact_out);
+
+    demand_result _demand(name account, name contract, asset quantity, int sym_index = -1);
+
+    demand_result _demand_single(name account, market_tlb::const_iterator mitr, asset quantity, int out_index);
+
+    // a single-sided withdrawal booked on the market, the caller pays the share and the admin fee
+    struct single_withdrawal {
+      demand_result result;
+      extended_asset admin_fee;
+    };
+
+    supply_result _supply(name account, market_tlb::const_iterator mitr, std::vector<asset> deposits);
+    demand_result _withdraw(market_tlb::const_iterator mitr, asset quantity);
+    single_withdrawal _withdraw_single(market_tlb::const_iterator mitr, asset quantity, int out_index);
+    void _migrate(name account, name contract, asset quantity, symbol_code target, uint64_t min_lpamount);
 
     void _transfer_out(name to, name contract, asset quantity, std::string memo);
 
     void _setlendable(market_tlb::const_iterator mitr, int index, bool lendable);
 
+    // progress of a paginated admin operation, resumed when it is called again with an empty cursor
+    struct [[eosio::table]] bulk_job {
+      name job;
+      extended_symbol sym;
+      bool flag;
+      symbol_code cursor;
+
+      uint64_t primary_key() const { return job.value; }
+    };
+    typedef eosio::multi_index<name("bulkjob"), bulk_job> bulkjob_tlb;
+    bulkjob_tlb bulkjobs;
+
+    void _save_bulkjob(name job, extended_symbol sym, bool flag, symbol_code cursor) {
+      auto itr = bulkjobs.find(job.value);
+      if (!cursor.raw()) {
+        if (itr != bulkjobs.end()) bulkjobs.erase(itr);
+        return;
+      }
+
+      if (itr == bulkjobs.end()) {
+        bulkjobs.emplace(_self, [&](auto& row) {
+          row.job = job;
+          row.sym = sym;
+          row.flag = flag;
+          row.cursor = cursor;
+        });
+      } else {
+        bulkjobs.modify(itr, _self, [&](auto& row) {
+          row.sym = sym;
+          row.flag = flag;
+          row.cursor = cursor;
+        });
+      }
+    };
+
     enum AllowType {
       ManualAllow = 1
     };
@@ -507,5 +871,81 @@ namespace pizzair {
     };
 
     void _on_lptoken_transfer(name from, name to, asset quantity, std::string memo);
+
+    // lend.pizza movements of the running action, netted per token and sent by _flush_lend
+    // before anything is paid out, so opposing flows of several markets cancel out
+    struct lend_move {
+      extended_symbol sym;
+      int64_t amount;
+    };
+    std::vector<lend_move> lend_moves;
+
+    void _lend_move(name contract, asset quantity) {
+      extended_symbol sym = extended_symbol(quantity.symbol, contract);
+      for (auto& move : lend_moves) {
+        if (move.sym == sym) {
+          move.amount += quantity.amount;
+          return;
+        }
+      }
+      lend_moves.push_back(lend_move{sym, quantity.amount});
+    };
+
+    void _lend_collateral(name contract, asset quantity) {
+      _lend_move(contract, quantity);
+    };
+
+    // quantity is either the anchor to redeem or the pz to burn, lend.pizza takes both
+    void _lend_withdraw(name contract, asset quantity) {
+      _lend_move(contract, -quantity);
+    };
+
+    void _flush_lend();
+
+    snapshot::market_record _market_record(market_tlb::const_iterator mitr);
+
+    template<typename T>
+    static void _append_record(std::vector<char>& data, const T& record) {
+      const char* p = reinterpret_cast<const char*>(&record);
+      data.insert(data.end(), p, p + sizeof(T));
+    };
+
+    // an open flash swap, it only lives between flashswap and flashsettle of one transaction
+    struct [[eosio::table]] flash {
+      symbol lptoken;
+      name account;
+      uint8_t out_index;
+      asset quantity;
+      std::vector<asset> repaids;
+
+      uint64_t primary_key() const {
+        return lptoken.code().raw();
+      }
+    };
+    typedef eosio::multi_index<name("flash"), flash> flash_tlb;
+    flash_tlb flashes;
+
+    // a swap queued on a batched market, scoped by lpsym and credited to claimable by settlebatch
+    struct [[eosio::table]] intent {
+      uint64_t id;
+      name account;
+      uint8_t in_index;
+      asset quantity;
+      uint64_t min_out;
+      uint32_t created_at;
+
+      uint64_t primary_key() const {
+        return id;
+      }
+    };
+    typedef eosio::multi_index<name("intent"), intent> intent_tlb;
+
+    swap_result _queue_intent(market_tlb::const_iterator mitr, int in_index, name account, asset quantity, uint64_t min_out);
+
+    void _check_not_flashing(symbol_code lpsym) {
+      check(flashes.find(lpsym.raw()) == flashes.end(), "market is in a flash swap");
+    };
+
+    void _flash_repay(symbol_code lpsym, name contract, asset quantity);
   };
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "common.hpp"
+#include "curve.hpp"
 
 #ifdef MAINNET
   #define LEND_CONTRACT name("lend.pizza")
@@ -111,11 +112,80 @@ namespace pizzalend {
 
   pztoken get_pztoken_byanchor(extended_symbol anchor) {
     auto pztokens_byanchor = pztokens.get_index<name("byanchor")>();
-    std::string msg = "pztoken with anchor " + anchor.get_symbol().code().to_string() + " not found";
-    return pztokens_byanchor.get(raw(anchor), msg.c_str());
+    auto itr = pztokens_byanchor.find(raw(anchor));
+    if (itr == pztokens_byanchor.end()) {
+      std::string msg = "pztoken with anchor " + anchor.get_symbol().code().to_string() + " not found";
+      check(false, msg.c_str());
+    }
+    return *itr;
   };
-  
+
   pztoken get_pztoken(name pzname) {
     return pztokens.get(pzname.value, "pztoken not found");
   };
+
+  // leading fields of a pztoken row, all that pz conversions need
+  struct pzrate {
+    name pzname;
+    extended_symbol pzsymbol;
+    extended_symbol anchor;
+    double pzprice;
+    double pzprice_rate;
+    uint64_t updated_at;
+
+    double cal_pzprice() const {
+      return pizzair::cal_pzprice(pzprice, pzprice_rate, updated_at, current_millis());
+    };
+
+    asset cal_pzquantity(asset quantity, double pzprice = 0) const {
+      check(quantity.symbol == anchor.get_symbol(), "attempt to calculate pzquantity with different anchor symbol");
+      if (pzprice == 0) {
+        pzprice = cal_pzprice();
+      }
+      symbol sym = pzsymbol.get_symbol();
+      return asset(pizzair::anchor_to_pz(quantity.amount, quantity.symbol.precision(), sym.precision(), pzprice), sym);
+    }
+
+    asset cal_anchor_quantity(asset pzquantity, double pzprice = 0) const {
+      check(pzquantity.symbol == pzsymbol.get_symbol(), "attempt to calculate anchor quantity with different pz symbol");
+      if (pzprice == 0) {
+        pzprice = cal_pzprice();
+      }
+      symbol sym = anchor.get_symbol();
+      return asset(pizzair::pz_to_anchor(pzquantity.amount, pzquantity.symbol.precision(), sym.precision(), pzprice), sym);
+    }
+  };
+
+  // pzname, pzsymbol, anchor, 7 assets and 4 decimals precede pzprice in a serialized pztoken row
+  #define PZPRICE_OFFSET (8 + 16*2 + 16*7 + 16*4)
+  #define PZRATE_SIZE (PZPRICE_OFFSET + 8*3)
+
+  pzrate get_pzrate(name pzname) {
+    int32_t itr = internal_use_do_not_use::db_find_i64(LEND_CONTRACT.value, LEND_CONTRACT.value, name("pztoken").value, pzname.value);
+    check(itr >= 0, "pztoken not found");
+
+    char buffer[PZRATE_SIZE];
+    int32_t size = internal_use_do_not_use::db_get_i64(itr, buffer, PZRATE_SIZE);
+    check(size >= PZRATE_SIZE, "unexpected pztoken layout");
+
+    pzrate pz;
+    datastream<const char*> ds(buffer, PZRATE_SIZE);
+    ds >> pz.pzname >> pz.pzsymbol >> pz.anchor;
+    ds.skip(PZPRICE_OFFSET - ds.tellp());
+    ds >> pz.pzprice >> pz.pzprice_rate >> pz.updated_at;
+    return pz;
+  };
+
+  name find_pzname_byanchor(extended_symbol anchor) {
+    // byanchor is the second secondary index of pztoken
+    uint64_t index_table = (name("pztoken").value & 0xFFFFFFFFFFFFFFF0ULL) | 1;
+    uint128_t secondary = raw(anchor);
+    uint64_t primary = 0;
+    int32_t itr = internal_use_do_not_use::db_idx128_find_secondary(LEND_CONTRACT.value, LEND_CONTRACT.value, index_table, &secondary, &primary);
+    if (itr < 0) {
+      std::string msg = "pztoken with anchor " + anchor.get_symbol().code().to_string() + " not found";
+      check(false, msg.c_str());
+    }
+    return name(primary);
+  };
 }
\ No newline at end of file
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// fixed layout records returned by the exportstate action, little endian and 8 bytes aligned.
+// a snapshot file is one section per table: a section_header followed by `count` records.
+// exportstate pages only carry records, the service writes the header once a table is done.
+namespace pizzair {
+namespace snapshot {
+  static constexpr uint32_t MAGIC = 0x53524941; // "AIRS"
+  static constexpr uint16_t VERSION = 1;
+
+  enum section : uint8_t {
+    MARKETS = 1,
+    POSITIONS = 2,
+  };
+
+  struct section_header {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t section;
+    uint8_t reserved;
+    uint64_t count;
+  };
+  static_assert(sizeof(section_header) == 16, "section_header layout changed");
+
+  // a market with its lend rates, leverage ramp and fee config folded in
+  struct market_record {
+    uint64_t lptoken;             // symbol raw, code and precision
+    uint64_t contracts[2];
+    uint64_t syms[2];             // symbol raw
+    int64_t reserves[2];          // anchor amounts
+    int64_t pzreserves[2];        // amounts kept in the row, pz on lendable sides
+    double pzprices[2];           // 0 on plain sides
+    double prices[2];
+    uint64_t lpamount;
+    double fee_rate;
+    double lp_rate;
+    uint32_t leverage;            // effective at export, LEVERAGE_DECIMALS
+    uint32_t target_leverage;
+    uint32_t ramp_begined_at;
+    uint32_t ramp_effective_secs;
+    uint8_t lendables[2];
+    uint8_t fee_index;
+    uint8_t reserved[5];
+  };
+  static_assert(sizeof(market_record) == 152, "market_record layout changed");
+
+  // a liqdt row
+  struct position_record {
+    uint64_t id;
+    uint64_t account;
+    uint64_t lptoken;             // symbol raw
+    uint64_t lpamount;
+    int64_t principals[2];
+  };
+  static_assert(sizeof(position_record) == 48, "position_record layout changed");
+}
+}
+
+#if !defined(__wasm__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+
+namespace pizzair {
+namespace snapshot {
+  template<typename T>
+  struct view {
+    const T* data = nullptr;
+    size_t size = 0;
+
+    const T* begin() const { return data; }
+    const T* end() const { return data + size; }
+    const T& operator[](size_t i) const { return data[i]; }
+  };
+
+  // maps a snapshot file read only, the views point straight into the mapping
+  class mapped_file {
+  public:
+    explicit mapped_file(const std::string& path) {
+      _fd = ::open(path.c_str(), O_RDONLY);
+      if (_fd < 0) throw std::runtime_error("cannot open " + path);
+
+      struct stat st;
+      if (::fstat(_fd, &st) != 0) {
+        ::close(_fd);
+        throw std::runtime_error("cannot stat " + path);
+      }
+      _size = st.st_size;
+
+      if (_size > 0) {
+        _base = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+        if (_base == MAP_FAILED) {
+          ::close(_fd);
+          throw std::runtime_error("cannot map " + path);
+        }
+      }
+
+      try {
+        _parse();
+      } catch (...) {
+        _release();
+        throw;
+      }
+    }
+
+    ~mapped_file() {
+      _release();
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    view<market_record> markets() const { return _markets; }
+    view<position_record> positions() const { return _positions; }
+
+  private:
+    int _fd = -1;
+    void* _base = nullptr;
+    size_t _size = 0;
+    view<market_record> _markets;
+    view<position_record> _positions;
+
+    void _release() {
+      if (_base && _base != MAP_FAILED) ::munmap(_base, _size);
+      if (_fd >= 0) ::close(_fd);
+      _base = nullptr;
+      _fd = -1;
+    }
+
+    template<typename T>
+    static view<T> _section(const char* p, uint64_t count, size_t left) {
+      if (count > left / sizeof(T)) throw std::runtime_error("truncated snapshot section");
+      return view<T>{reinterpret_cast<const T*>(p), (size_t)count};
+    }
+
+    void _parse() {
+      const char* p = static_cast<const char*>(_base);
+      size_t left = _size;
+      while (left > 0) {
+        if (left < sizeof(section_header)) throw std::runtime_error("truncated snapshot header");
+        const section_header* header = reinterpret_cast<const section_header*>(p);
+        if (header->magic != MAGIC) throw std::runtime_error("not an air snapshot");
+        if (header->version != VERSION) throw std::runtime_error("unsupported snapshot version");
+        p += sizeof(section_header);
+        left -= sizeof(section_header);
+
+        size_t bytes = 0;
+        if (header->section == MARKETS) {
+          _markets = _section<market_record>(p, header->count, left);
+          bytes = _markets.size * sizeof(market_record);
+        } else if (header->section == POSITIONS) {
+          _positions = _section<position_record>(p, header->count, left);
+          bytes = _positions.size * sizeof(position_record);
+        } else {
+          throw std::runtime_error("unknown snapshot section");
+        }
+        p += bytes;
+        left -= bytes;
+      }
+    }
+  };
+}
+}
+#endif
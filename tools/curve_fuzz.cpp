@@ -0,0 +1,467 @@
+// property fuzzer for the market arithmetic in curve.hpp. every run drives random markets through
+// random sequences of swap, supply, demand, single-sided demand, lp transfer, leverage ramp and
+// clock operations, applying each one to the reserves, lpamount and per-account lp the way the
+// contract does, and checks after every step:
+//
+//   accuracy      p_to_q against a long double reference of the invariant
+//   conservation  no operation lowers D per lp token for the lps that stay, rounding included
+//   lp ledger     the per-account lp (liqdt) adds up to lpamount, reserves never go negative
+//   pricing       the marginal price moves against a swap and never beats the fill, ramps are monotone
+//   helpers       q_to_p inverts p_to_q, exact_in is sufficient and minimal, clear_price clears
+//                 between Y/X and the marginal price, pz round trips never give back more
+//
+//   g++ -std=c++17 -O2 -ffp-contract=off -o fuzz tools/curve_fuzz.cpp && ./fuzz [markets] [ops] [seed]
+//
+// the first failures of every property are printed, the exit code is 1 when any property failed.
+
+#include "../curve.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace pizzair;
+
+static constexpr int ACCOUNTS = 6;
+static constexpr uint8_t LP_PRECISION = 4;
+static constexpr double LEVERAGE_UNIT = 10000;
+
+// D per lp may only drop by this much, relative, it absorbs the reference's own rounding
+static constexpr long double D_TOLERANCE = 1e-12L;
+static constexpr double CLEAR_TOLERANCE = 1e-9;
+static constexpr long double PRICE_TOLERANCE = 1e-12L;
+
+// the invariant in long double: 4A(x+y) + D = 4AD + D^3/(4xy)
+static long double ref_D(long double A, long double x, long double y) {
+  long double n = 4*(4*A - 1)*x*y;
+  long double m = -16*A*x*y*(x+y);
+  long double D = x + y;
+  for (int i = 0; i < 100; i++) {
+    long double f = D*D*D + n*D + m;
+    long double step = f / (3*D*D + n);
+    D -= step;
+    if (fabsl(step) <= D * 1e-19L) break;
+  }
+  return D;
+}
+
+// the y that keeps D once x is x1, the positive root of 4A y^2 + b y - D^3/(4 x1) = 0
+static long double ref_y(long double A, long double x1, long double D) {
+  long double a = 4*A;
+  long double b = 4*A*x1 + D - 4*A*D;
+  long double c = D*D*D / (4*x1);
+  long double root = sqrtl(b*b + 4*a*c);
+  return b > 0 ? 2*c / (b + root) : (root - b) / (2*a);
+}
+
+// p_to_q cancels terms of the size of x + y, so its absolute error is counted in ulps of x + y and
+// not of q. measured against the reference it is ~1e-14 of x + y on a balanced pool and grows with
+// the imbalance, to ~1e-9 of it at 1:1e11. these bounds sit a few times above what was measured
+static double imbalance(double x, double y) {
+  return std::max(x, y) / std::min(x, y);
+}
+
+static double p_to_q_error(double x, double y) {
+  return (x + y) * 1e-13 * std::max(1.0, pow(imbalance(x, y), 2.0 / 3) * 1e-3);
+}
+
+// q_to_p loses digits faster, ~1e-16 of x + y per unit of imbalance. it is only the first guess
+// exact_in corrects, so exact_in is held to the exact properties and q_to_p to this bound
+static double q_to_p_error(double x, double y) {
+  return (x + y) * 1e-13 * std::max(1.0, imbalance(x, y) * 1e-3);
+}
+
+static long double ref_q(long double p, long double A, long double x, long double y) {
+  return y - ref_y(A, x + p, ref_D(A, x, y));
+}
+
+// -dy/dx from the partial derivatives of the invariant
+static long double ref_price(long double A, long double x, long double y) {
+  long double D3 = powl(ref_D(A, x, y), 3);
+  return (4*A + D3 / (4*x*x*y)) / (4*A + D3 / (4*x*y*y));
+}
+
+struct property {
+  const char* name;
+  uint64_t checked = 0;
+  uint64_t failed = 0;
+
+  template<typename... Args>
+  void check(bool ok, const char* fmt, Args... args) {
+    checked++;
+    if (ok) return;
+    if (failed++ < 5) {
+      fprintf(stderr, "%s: ", name);
+      fprintf(stderr, fmt, args...);
+      fprintf(stderr, "\n");
+    }
+  }
+};
+
+static property accuracy{"p_to_q accuracy"};
+static property swap_kept{"swap keeps D"};
+static property supply_kept{"supply keeps D per lp"};
+static property demand_kept{"demand keeps D per lp"};
+static property single_kept{"single demand keeps D"};
+static property ledger{"lp ledger"};
+static property price_moves{"swap moves price"};
+static property fill_price{"fill within price"};
+static property ramp_monotone{"ramp monotone"};
+static property inverse{"q_to_p inverse"};
+static property sufficient{"exact_in sufficient"};
+static property minimal{"exact_in minimal"};
+static property residual{"clear_price residual"};
+static property between{"clear_price between"};
+static property pz_round{"pz round trip"};
+
+// a market as the contract keeps it, plain sides, reserves in the smallest unit
+struct sim_market {
+  uint32_t from, to, begined_at, effective_secs;
+  uint32_t now;
+  uint8_t precisions[2];
+  int64_t reserves[2];
+  int64_t lpamount;
+  double fee_rate;
+  double lp_rate;
+  int fee_index;
+  int64_t lps[ACCOUNTS];
+
+  double A() const {
+    return ramp_leverage(from, to, now - begined_at, effective_secs) / LEVERAGE_UNIT;
+  }
+
+  double unit(int i) const { return pow(10, precisions[i]); }
+  double r(int i) const { return reserves[i] / unit(i); }
+
+  long double D() const {
+    return ref_D(A(), r(0), r(1));
+  }
+
+  // D per lp token, what an lp that stays owns
+  long double D_per_lp() const {
+    return D() / lpamount;
+  }
+};
+
+struct fuzzer {
+  std::mt19937_64 rng;
+  std::uniform_real_distribution<double> uniform{0, 1};
+  uint64_t ops = 0, rejected = 0;
+
+  explicit fuzzer(uint64_t seed) : rng(seed) {}
+
+  double unit() { return uniform(rng); }
+
+  // lp supply must match the ledger and nothing may go negative
+  void check_ledger(const sim_market& m, const char* op) {
+    int64_t total = 0;
+    for (int64_t lp : m.lps) total += lp;
+    bool emptied = m.lpamount > 0 || (m.reserves[0] == 0 && m.reserves[1] == 0);
+    ledger.check(total == m.lpamount && m.reserves[0] >= 0 && m.reserves[1] >= 0 && emptied,
+                 "after %s: liqdt %lld lpamount %lld reserves %lld %lld", op, (long long)total, (long long)m.lpamount,
+                 (long long)m.reserves[0], (long long)m.reserves[1]);
+  }
+
+  void first_supply(sim_market& m) {
+    int64_t amount = (int64_t)pow(10, 3 + unit() * 6);
+    m.precisions[1] = m.precisions[0];
+    int64_t deposits[2] = {amount, amount};
+    supply_quote quote = quote_supply(deposits, m.reserves, m.precisions, 0, LP_PRECISION, m.A());
+    if (quote.error != SUPPLY_OK || quote.lpamount <= 0) {
+      rejected++;
+      return;
+    }
+    m.reserves[0] = m.reserves[1] = amount;
+    m.lpamount = quote.lpamount;
+    m.lps[rng() % ACCOUNTS] += quote.lpamount;
+  }
+
+  void swap(sim_market& m) {
+    int in = rng() % 2, out = 1 - in;
+    double A = m.A(), x = m.r(in), y = m.r(out);
+    bool fee_on_in = m.fee_index == in;
+    int64_t amount = 1 + (int64_t)(m.reserves[in] * pow(10, -7 + unit() * 6.7));
+
+    swap_quote quote = quote_swap(amount, A, x, y, m.precisions[in], m.precisions[out], m.fee_rate, m.lp_rate, fee_on_in);
+    int64_t incr = fee_on_in ? amount - quote.admin_fee : amount;
+    int64_t decr = fee_on_in ? quote.got : quote.got + quote.admin_fee;
+    if (quote.got <= 0 || decr >= m.reserves[out] || (m.fee_rate > 0 && quote.admin_fee <= 0)) {
+      rejected++;
+      return;
+    }
+
+    double p = (fee_on_in ? amount - quote.fee : amount) / m.unit(in);
+    double q = p_to_q(p, A, x, y);
+    long double expected = ref_q(p, A, x, y);
+    accuracy.check(fabsl(q - expected) <= p_to_q_error(x, y), "A=%.17g x=%.17g y=%.17g p=%.17g q=%.17g ref=%.17Lg", A, x, y, p, q, expected);
+
+    // the fill pays out no more than the marginal price before it allows, give or take what p_to_q
+    // may be off by, which on a swap without fee can round the payout up by one unit
+    long double marginal = ref_price(A, x, y);
+    long double paid = amount / (long double)m.unit(in);
+    long double got = quote.got / (long double)m.unit(out);
+    fill_price.check(got <= paid * marginal * (1 + PRICE_TOLERANCE) + p_to_q_error(x, y),
+                     "A=%.17g x=%.17g y=%.17g amount=%lld got=%lld marginal=%.17Lg", A, x, y, (long long)amount, (long long)quote.got, marginal);
+
+    long double before = m.D();
+    m.reserves[in] += incr;
+    m.reserves[out] -= decr;
+    long double after = m.D();
+    swap_kept.check(after >= before * (1 - D_TOLERANCE), "A=%.17g x=%.17g y=%.17g amount=%lld got=%lld D %.20Lg -> %.20Lg", A, x, y, (long long)amount, (long long)quote.got, before, after);
+
+    long double moved = ref_price(A, m.r(in), m.r(out));
+    price_moves.check(moved <= marginal * (1 + PRICE_TOLERANCE), "A=%.17g x=%.17g y=%.17g amount=%lld price %.17Lg -> %.17Lg", A, x, y, (long long)amount, marginal, moved);
+  }
+
+  void supply(sim_market& m) {
+    int64_t deposits[2];
+    int mode = rng() % 3;
+    double share = pow(10, -6 + unit() * 5.5);
+    for (int i = 0; i <= 1; i++) {
+      deposits[i] = (int64_t)(m.reserves[i] * share);
+    }
+    if (mode == 1) {
+      // off the pool ratio
+      int i = rng() % 2;
+      deposits[i] = (int64_t)(deposits[i] * (1 + unit()));
+    } else if (mode == 2) {
+      deposits[rng() % 2] = 0;
+    }
+    if (deposits[0] <= 0 && deposits[1] <= 0) return;
+    if (deposits[0] < 0) deposits[0] = 0;
+    if (deposits[1] < 0) deposits[1] = 0;
+
+    supply_quote quote = quote_supply(deposits, m.reserves, m.precisions, m.lpamount, LP_PRECISION, m.A());
+    if (quote.error != SUPPLY_OK || quote.lpamount <= 0) {
+      rejected++;
+      return;
+    }
+
+    long double before = m.D_per_lp();
+    if (quote.dropped > 0) deposits[quote.extra_index] -= quote.dropped;
+    m.reserves[0] += deposits[0];
+    m.reserves[1] += deposits[1];
+    m.lpamount += quote.lpamount;
+    m.lps[rng() % ACCOUNTS] += quote.lpamount;
+    long double after = m.D_per_lp();
+    supply_kept.check(after >= before * (1 - D_TOLERANCE), "A=%.17g reserves %lld %lld deposits %lld %lld lp %lld D/lp %.20Lg -> %.20Lg",
+                      m.A(), (long long)m.reserves[0], (long long)m.reserves[1], (long long)deposits[0], (long long)deposits[1],
+                      (long long)quote.lpamount, before, after);
+  }
+
+  // an account holding lp, -1 when none does
+  int holder(const sim_market& m) {
+    int start = rng() % ACCOUNTS;
+    for (int k = 0; k < ACCOUNTS; k++) {
+      int a = (start + k) % ACCOUNTS;
+      if (m.lps[a] > 0) return a;
+    }
+    return -1;
+  }
+
+  int64_t part_of(int64_t lp) {
+    return rng() % 4 == 0 ? lp : std::max<int64_t>(1, (int64_t)(lp * unit()));
+  }
+
+  void demand(sim_market& m) {
+    int a = holder(m);
+    if (a < 0) return;
+    int64_t quantity = part_of(m.lps[a]);
+
+    long double before = m.lpamount > quantity ? m.D_per_lp() : 0;
+    int64_t gots[2];
+    for (int i = 0; i <= 1; i++) {
+      gots[i] = withdraw_share(m.reserves[i], quantity, m.lpamount);
+      m.reserves[i] -= gots[i];
+    }
+    m.lpamount -= quantity;
+    m.lps[a] -= quantity;
+    if (m.lpamount > 0 && m.reserves[0] > 0 && m.reserves[1] > 0) {
+      long double after = m.D_per_lp();
+      demand_kept.check(after >= before * (1 - D_TOLERANCE), "A=%.17g lp %lld of %lld gots %lld %lld D/lp %.20Lg -> %.20Lg",
+                        m.A(), (long long)quantity, (long long)(m.lpamount + quantity), (long long)gots[0], (long long)gots[1], before, after);
+    }
+  }
+
+  // _withdraw_single: the in side of the share is swapped against what the other lps keep
+  void demand_single(sim_market& m) {
+    int a = holder(m);
+    if (a < 0) return;
+    int64_t quantity = part_of(m.lps[a]);
+    if (quantity == m.lpamount) {
+      rejected++;
+      return;
+    }
+
+    int out = rng() % 2, in = 1 - out;
+    int64_t shares[2];
+    for (int i = 0; i <= 1; i++) {
+      shares[i] = withdraw_share(m.reserves[i], quantity, m.lpamount);
+    }
+    int64_t decrs[2] = {0, 0};
+    decrs[out] = shares[out];
+    if (shares[in] > 0) {
+      double x = (m.reserves[in] - shares[in]) / m.unit(in);
+      double y = (m.reserves[out] - shares[out]) / m.unit(out);
+      swap_quote quote = quote_swap(shares[in], m.A(), x, y, m.precisions[in], m.precisions[out], m.fee_rate, m.lp_rate, m.fee_index == in);
+      if (m.fee_rate > 0 && quote.admin_fee <= 0) {
+        rejected++;
+        return;
+      }
+      decrs[out] += quote.got;
+      decrs[m.fee_index] += quote.admin_fee;
+    }
+    if (decrs[0] >= m.reserves[0] || decrs[1] >= m.reserves[1]) {
+      rejected++;
+      return;
+    }
+
+    long double before = m.D_per_lp();
+    m.reserves[0] -= decrs[0];
+    m.reserves[1] -= decrs[1];
+    m.lpamount -= quantity;
+    m.lps[a] -= quantity;
+    long double after = m.D_per_lp();
+    single_kept.check(after >= before * (1 - D_TOLERANCE), "A=%.17g lp %lld out %d decrs %lld %lld D/lp %.20Lg -> %.20Lg",
+                      m.A(), (long long)quantity, out, (long long)decrs[0], (long long)decrs[1], before, after);
+  }
+
+  // lptoken transfers move the liqdt row with them
+  void transfer(sim_market& m) {
+    int a = holder(m);
+    if (a < 0) return;
+    int b = rng() % ACCOUNTS;
+    int64_t quantity = part_of(m.lps[a]);
+    m.lps[a] -= quantity;
+    m.lps[b] += quantity;
+  }
+
+  void ramp(sim_market& m) {
+    uint32_t current = ramp_leverage(m.from, m.to, m.now - m.begined_at, m.effective_secs);
+    m.from = current;
+    m.to = (uint32_t)((1 + unit() * 499) * LEVERAGE_UNIT);
+    m.begined_at = m.now;
+    m.effective_secs = rng() % 4 == 0 ? 0 : rng() % 86400;
+
+    uint32_t t1 = rng() % (m.effective_secs + 2);
+    uint32_t t2 = t1 + rng() % (m.effective_secs + 2);
+    uint32_t a1 = ramp_leverage(m.from, m.to, t1, m.effective_secs);
+    uint32_t a2 = ramp_leverage(m.from, m.to, t2, m.effective_secs);
+    bool up = m.to >= m.from;
+    bool inside = std::min(m.from, m.to) <= a1 && a1 <= std::max(m.from, m.to);
+    ramp_monotone.check(inside && (up ? a1 <= a2 : a1 >= a2), "from %u to %u secs %u: %u at %u, %u at %u",
+                        m.from, m.to, m.effective_secs, a1, t1, a2, t2);
+  }
+
+  // stateless helpers checked against the current market
+  void helpers(sim_market& m) {
+    double A = m.A(), x = m.r(0), y = m.r(1);
+
+    // compared on the q side, where a flat price cannot blow the error up
+    double p = x * pow(10, -6 + unit() * 5.5);
+    double q = p_to_q(p, A, x, y);
+    double again = p_to_q(q_to_p(q, A, x, y), A, x, y);
+    inverse.check(fabs(again - q) <= q_to_p_error(x, y), "A=%.17g x=%.17g y=%.17g p=%.17g q=%.17g again=%.17g", A, x, y, p, q, again);
+
+    bool fee_on_in = m.fee_index == 0;
+    int64_t out = 1 + (int64_t)(m.reserves[1] * unit() * 0.5);
+    int64_t amount = exact_in(out, A, x, y, m.precisions[0], m.precisions[1], m.fee_rate, fee_on_in);
+    int64_t gross_out = fee_on_in ? out : amount_before_fee(out, m.fee_rate);
+    if (amount < 0) {
+      sufficient.check(gross_out >= m.reserves[1], "A=%.17g x=%.17g y=%.17g out=%lld rejected as more than the reserve", A, x, y, (long long)out);
+    } else if (amount > 0) {
+      int64_t got = quote_swap(amount, A, x, y, m.precisions[0], m.precisions[1], m.fee_rate, 0, fee_on_in).got;
+      sufficient.check(got >= out, "A=%.17g x=%.17g y=%.17g out=%lld amount=%lld got=%lld", A, x, y, (long long)out, (long long)amount, (long long)got);
+      if (amount > 1) {
+        int64_t less = quote_swap(amount - 1, A, x, y, m.precisions[0], m.precisions[1], m.fee_rate, 0, fee_on_in).got;
+        minimal.check(less < out, "A=%.17g x=%.17g y=%.17g out=%lld amount=%lld got(amount-1)=%lld", A, x, y, (long long)out, (long long)amount, (long long)less);
+      }
+    } else {
+      sufficient.check(false, "A=%.17g x=%.17g y=%.17g out=%lld unsolved (%lld)", A, x, y, (long long)out, (long long)amount);
+    }
+
+    double X = x * unit() * 0.3;
+    double Y = y * unit() * 0.3;
+    if (X > 0 && Y > 0) {
+      double marginal = ref_price(A, x, y);
+      double P = clear_price(A, x, y, X, Y);
+      double lo = std::min(Y / X, marginal);
+      double hi = std::max(Y / X, marginal);
+      between.check(P >= lo * (1 - CLEAR_TOLERANCE) && P <= hi * (1 + CLEAR_TOLERANCE), "A=%.17g x=%.17g y=%.17g X=%.17g Y=%.17g P=%.17g not in [%.17g, %.17g]", A, x, y, X, Y, P, lo, hi);
+
+      // the pool leg against what the other side leaves over, in units of the side the pool pays
+      double gap = 0, paid = 0;
+      if (X * P > Y) {
+        paid = X * P;
+        gap = fabs(X * P - Y - p_to_q(X - Y / P, A, x, y));
+      } else if (X * P < Y) {
+        paid = Y / P;
+        gap = fabs(Y / P - X - p_to_q(Y - X * P, A, y, x));
+      }
+      residual.check(gap <= paid * CLEAR_TOLERANCE + p_to_q_error(x, y), "A=%.17g x=%.17g y=%.17g X=%.17g Y=%.17g P=%.17g gap=%.3g", A, x, y, X, Y, P, gap);
+    }
+
+    // a lendable side would hold the reserve as pz, the interest only ever grows the price
+    uint8_t pz_precision = rng() % 9;
+    double pzprice = cal_pzprice(1 + unit(), unit() * 1e-8, 0, (uint64_t)(unit() * 1e10));
+    int64_t anchor = m.reserves[0];
+    int64_t pz = anchor_to_pz(anchor, m.precisions[0], pz_precision, pzprice);
+    int64_t back = pz_to_anchor(pz, pz_precision, m.precisions[0], pzprice);
+    pz_round.check(back <= anchor, "anchor=%lld precision=%d pz_precision=%d pzprice=%.17g pz=%lld back=%lld",
+                   (long long)anchor, m.precisions[0], pz_precision, pzprice, (long long)pz, (long long)back);
+  }
+
+  void run(uint64_t steps) {
+    sim_market m = {};
+    m.precisions[0] = rng() % 9;
+    m.precisions[1] = rng() % 9;
+    m.from = m.to = (uint32_t)((1 + unit() * 499) * LEVERAGE_UNIT);
+    m.now = 1700000000;
+    m.begined_at = m.now;
+    m.fee_rate = rng() % 8 == 0 ? 0 : unit() * 0.01;
+    m.lp_rate = unit();
+    m.fee_index = rng() % 2;
+
+    first_supply(m);
+    for (uint64_t s = 0; s < steps && m.lpamount > 0; s++) {
+      const char* op;
+      switch (rng() % 16) {
+        case 0: case 1: case 2: case 3: case 4: case 5: op = "swap"; swap(m); break;
+        case 6: case 7: op = "supply"; supply(m); break;
+        case 8: op = "demand"; demand(m); break;
+        case 9: op = "single demand"; demand_single(m); break;
+        case 10: op = "transfer"; transfer(m); break;
+        case 11: op = "ramp"; ramp(m); break;
+        case 12: case 13: op = "clock"; m.now += rng() % 7200; break;
+        default: op = "helpers"; helpers(m); break;
+      }
+      ops++;
+      check_ledger(m, op);
+      if (m.reserves[0] <= 0 || m.reserves[1] <= 0) break;
+    }
+  }
+};
+
+int main(int argc, char** argv) {
+  uint64_t markets = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000;
+  uint64_t steps = argc > 2 ? strtoull(argv[2], nullptr, 10) : 500;
+  uint64_t seed = argc > 3 ? strtoull(argv[3], nullptr, 10) : 20261019;
+
+  fuzzer f(seed);
+  auto started = std::chrono::steady_clock::now();
+  for (uint64_t k = 0; k < markets; k++) {
+    f.run(steps);
+  }
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  bool ok = true;
+  for (const property* p : {&accuracy, &swap_kept, &supply_kept, &demand_kept, &single_kept, &ledger, &price_moves, &fill_price,
+                            &ramp_monotone, &inverse, &sufficient, &minimal, &residual, &between, &pz_round}) {
+    printf("%-24s %10llu checked %6llu failed\n", p->name, (unsigned long long)p->checked, (unsigned long long)p->failed);
+    ok = ok && p->failed == 0;
+  }
+  printf("%llu operations, %llu rejected, %.0f ops/s\n", (unsigned long long)f.ops, (unsigned long long)f.rejected, f.ops / secs);
+  return ok ? 0 : 1;
+}
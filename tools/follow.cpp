@@ -0,0 +1,155 @@
+// replays a recorded log.pizza feed through follower.hpp while reader threads quote against the
+// published snapshots, the way a quoting service would sit behind a live feed. it prints the state
+// each market ends in, with the lp its accounts hold next to the market's lpamount, and how many
+// snapshots the readers went through.
+//
+//   g++ -std=c++17 -O2 -ffp-contract=off -pthread -o follow tools/follow.cpp
+//   ./follow [-p events] [-r readers] <feed file>
+//
+//   -p <events>      publish every that many applied events, 256 by default, and at the end
+//   -r <readers>     reader threads, 2 by default
+//
+// readers check that the snapshots they see never go back, every market in them quotes a swap of
+// one unit of its first token.
+
+#include "follower.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace pizzair;
+
+struct reader_stats {
+  uint64_t snapshots = 0;
+  uint64_t quotes = 0;
+  uint64_t regressions = 0;
+};
+
+static void read_snapshots(const follower::follower& f, const std::atomic<bool>& done, reader_stats& s) {
+  uint64_t last_sequence = 0;
+  while (true) {
+    bool last = done.load(std::memory_order_acquire);
+    std::shared_ptr<const follower::state> snapshot = f.snapshot();
+    if (snapshot->sequence < last_sequence) s.regressions++;
+    if (snapshot->sequence != last_sequence) s.snapshots++;
+    last_sequence = snapshot->sequence;
+
+    for (auto& itr : snapshot->markets) {
+      const follower::market_state& m = *itr.second;
+      if (m.reserves[0] <= 0 || m.reserves[1] <= 0) continue;
+      int64_t unit = pow(10, m.tokens[0].precision);
+      swap_quote quote = m.quote(0, unit, snapshot->millis);
+      if (quote.got > 0) s.quotes++;
+    }
+    if (last) break;
+  }
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [-p events] [-r readers] <feed file>\n", name);
+}
+
+int main(int argc, char** argv) {
+  uint64_t publish_every = 256;
+  int readers = 2;
+
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    if (arg + 1 >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    const char* flag = argv[arg];
+    int value = atoi(argv[++arg]);
+    if (strcmp(flag, "-p") == 0 && value > 0) {
+      publish_every = value;
+    } else if (strcmp(flag, "-r") == 0 && value >= 0) {
+      readers = value;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - arg != 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  std::ifstream feed(argv[arg]);
+  if (!feed) {
+    fprintf(stderr, "cannot open %s\n", argv[arg]);
+    return 1;
+  }
+
+  follower::follower f;
+  std::atomic<bool> done(false);
+  std::vector<reader_stats> stats(readers);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < readers; i++) {
+    threads.emplace_back(read_snapshots, std::cref(f), std::cref(done), std::ref(stats[i]));
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  std::string line;
+  size_t line_no = 0;
+  uint64_t unpublished = 0, skipped = 0;
+  follower::event e;
+  while (std::getline(feed, line)) {
+    line_no++;
+    if (line.empty() || line[0] == '#') continue;
+    if (!follower::parse_event(line, e) || !f.apply(e)) {
+      fprintf(stderr, "skipped line %zu: %s\n", line_no, line.c_str());
+      skipped++;
+      continue;
+    }
+    if (++unpublished >= publish_every) {
+      f.publish();
+      unpublished = 0;
+    }
+  }
+  std::shared_ptr<const follower::state> last = f.publish();
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  done.store(true, std::memory_order_release);
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  int mismatches = 0;
+  for (auto& itr : last->markets) {
+    const follower::market_state& m = *itr.second;
+    int64_t held = 0;
+    for (auto& liqdt : *m.liqdts) {
+      held += liqdt.second;
+    }
+    if ((uint64_t)held != m.lpamount) mismatches++;
+
+    printf("%s reserves %lld %s %lld %s lp %llu held %lld by %zu A %.4f fee_rate %.8f lp_rate %.8f fee_index %d"
+           " swaps %llu supplies %llu demands %llu batches %llu volumes %lld %lld fees %lld %lld%s\n",
+           m.lpsym.c_str(), (long long)m.reserves[0], m.tokens[0].code.c_str(), (long long)m.reserves[1], m.tokens[1].code.c_str(),
+           (unsigned long long)m.lpamount, (long long)held, m.liqdts->size(), m.leverage(last->millis), m.fee_rate, m.lp_rate,
+           m.fee_index, (unsigned long long)m.swaps, (unsigned long long)m.supplies, (unsigned long long)m.demands,
+           (unsigned long long)m.batches, (long long)m.volumes[0], (long long)m.volumes[1], (long long)m.fees[0],
+           (long long)m.fees[1], (uint64_t)held == m.lpamount ? "" : " MISMATCH");
+  }
+
+  reader_stats total;
+  for (auto& s : stats) {
+    total.snapshots += s.snapshots;
+    total.quotes += s.quotes;
+    total.regressions += s.regressions;
+  }
+  fprintf(stderr, "applied %llu skipped %llu published %llu in %.3fs (%.0f events/s)\n", (unsigned long long)f.applied(),
+          (unsigned long long)skipped, (unsigned long long)last->sequence, secs, secs > 0 ? f.applied() / secs : 0);
+  fprintf(stderr, "%d readers saw %llu snapshots, quoted %llu swaps, %llu went back\n", readers,
+          (unsigned long long)total.snapshots, (unsigned long long)total.quotes, (unsigned long long)total.regressions);
+
+  return mismatches > 0 || total.regressions > 0 || skipped > 0 ? 1 : 0;
+}
@@ -0,0 +1,422 @@
+#pragma once
+
+// keeps the state of every market from the events the contract sends to log.pizza, for off-chain
+// readers that quote against it without polling the tables. one writer applies events in the order
+// they were logged and publishes immutable snapshots, readers take the latest one without a lock
+// and keep it as long as they need, the writer never touches a published snapshot again.
+//
+// a feed has one log action per line, tab separated because asset strings carry a space, lines
+// starting with # are skipped:
+//
+//   <millis>\t<event>\t<arg 0>\t<arg 1>...
+//
+// markets are copied on their first change after a publish and the rest are shared with the
+// previous snapshot, so publishing every few hundred events costs about the markets touched.
+// the feed has to start at the first action of every market it follows, an exportstate snapshot
+// does not carry the ramp origin nor the accounts to start from.
+
+#include "../curve.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace pizzair {
+namespace follower {
+  static constexpr double LEVERAGE_UNIT = 10000;
+
+  struct token {
+    std::string code;
+    uint8_t precision = 0;
+    std::string contract;
+  };
+
+  // lp amount of every account holding the market's lp tokens
+  typedef std::map<std::string, int64_t> liqdt_map;
+
+  struct market_state {
+    std::string lpsym;
+    uint8_t lp_precision = 0;
+    token tokens[2];
+    int64_t reserves[2] = {0, 0};   // anchor amounts, as _swap quotes them
+    double prices[2] = {0, 0};
+    uint64_t lpamount = 0;
+    uint32_t ramp_from = 0;         // LEVERAGE_DECIMALS
+    uint32_t ramp_to = 0;
+    uint32_t ramp_begined_at = 0;
+    uint32_t ramp_effective_secs = 0;
+    double fee_rate = 0;
+    double lp_rate = 0.5;
+    int fee_index = 0;
+    uint64_t swaps = 0, supplies = 0, demands = 0, batches = 0;
+    int64_t volumes[2] = {0, 0};
+    int64_t fees[2] = {0, 0};
+    double clear_price = 0;         // of the last batch
+    std::shared_ptr<const liqdt_map> liqdts = std::make_shared<liqdt_map>();
+
+    // -1 when the code is not one of the market's tokens
+    int side(const std::string& code) const {
+      for (int i = 0; i <= 1; i++) {
+        if (tokens[i].code == code) return i;
+      }
+      return -1;
+    }
+
+    double leverage(uint64_t millis) const {
+      uint32_t secs = millis / 1000;
+      uint32_t passed = secs > ramp_begined_at ? secs - ramp_begined_at : 0;
+      return ramp_leverage(ramp_from, ramp_to, passed, ramp_effective_secs) / LEVERAGE_UNIT;
+    }
+
+    double reserve(int i) const {
+      return reserves[i] / pow(10, tokens[i].precision);
+    }
+
+    // what the market would pay for amount of side in, as _swap quotes it at millis
+    swap_quote quote(int in, int64_t amount, uint64_t millis) const {
+      int out = 1 - in;
+      return quote_swap(amount, leverage(millis), reserve(in), reserve(out), tokens[in].precision, tokens[out].precision,
+                        fee_rate, lp_rate, fee_index == in);
+    }
+  };
+
+  struct state {
+    uint64_t sequence = 0;          // publishes so far
+    uint64_t events = 0;            // events applied
+    uint64_t millis = 0;            // of the last event applied
+    std::map<std::string, std::shared_ptr<const market_state>> markets;
+
+    const market_state* market(const std::string& lpsym) const {
+      auto itr = markets.find(lpsym);
+      return itr == markets.end() ? nullptr : itr->second.get();
+    }
+  };
+
+  struct event {
+    uint64_t millis = 0;
+    std::string name;
+    std::vector<std::string> args;
+  };
+
+  inline bool parse_event(const std::string& line, event& e) {
+    if (line.empty() || line[0] == '#') return false;
+
+    std::vector<std::string> fields;
+    size_t begin = 0;
+    while (true) {
+      size_t end = line.find('\t', begin);
+      fields.push_back(line.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+      if (end == std::string::npos) break;
+      begin = end + 1;
+    }
+    if (fields.size() < 2 || fields[0].empty() || fields[1].empty()) return false;
+
+    char* end = nullptr;
+    e.millis = strtoull(fields[0].c_str(), &end, 10);
+    if (*end != 0) return false;
+    e.name = fields[1];
+    e.args.assign(fields.begin() + 2, fields.end());
+    return true;
+  }
+
+  inline bool parse_uint(const std::string& s, uint64_t& value) {
+    if (s.empty() || s[0] == '-') return false;
+    char* end = nullptr;
+    value = strtoull(s.c_str(), &end, 10);
+    return *end == 0;
+  }
+
+  inline bool parse_int(const std::string& s, int64_t& value) {
+    if (s.empty()) return false;
+    char* end = nullptr;
+    value = strtoll(s.c_str(), &end, 10);
+    return *end == 0;
+  }
+
+  inline bool parse_double(const std::string& s, double& value) {
+    if (s.empty()) return false;
+    char* end = nullptr;
+    value = strtod(s.c_str(), &end);
+    return *end == 0;
+  }
+
+  // asset::to_string, "-12.3400 USDT"
+  inline bool parse_asset(const std::string& s, int64_t& amount, uint8_t& precision, std::string& code) {
+    size_t space = s.find(' ');
+    if (space == std::string::npos || space == 0 || space + 1 == s.size()) return false;
+    code = s.substr(space + 1);
+
+    bool negative = s[0] == '-';
+    uint64_t value = 0;
+    precision = 0;
+    bool fraction = false;
+    for (size_t i = negative ? 1 : 0; i < space; i++) {
+      char c = s[i];
+      if (c == '.' && !fraction) {
+        fraction = true;
+        continue;
+      }
+      if (c < '0' || c > '9') return false;
+      value = value * 10 + (c - '0');
+      if (fraction) precision++;
+    }
+    amount = negative ? -(int64_t)value : (int64_t)value;
+    return true;
+  }
+
+  // a decimal is an asset of FLOAT, its amount is all readers need
+  inline bool parse_decimal(const std::string& s, double& value) {
+    int64_t amount;
+    uint8_t precision;
+    std::string code;
+    if (!parse_asset(s, amount, precision, code)) return false;
+    value = amount / pow(10, precision);
+    return true;
+  }
+
+  // _sym_to_string, "4,USDT@tethertether"
+  inline bool parse_token(const std::string& s, token& t) {
+    size_t comma = s.find(',');
+    size_t at = s.find('@');
+    if (comma == std::string::npos || at == std::string::npos || comma == 0 || at <= comma + 1 || at + 1 == s.size()) return false;
+    uint64_t precision;
+    if (!parse_uint(s.substr(0, comma), precision) || precision > 18) return false;
+    t.precision = precision;
+    t.code = s.substr(comma + 1, at - comma - 1);
+    t.contract = s.substr(at + 1);
+    return true;
+  }
+
+  // legacy rows kept leverage without decimals, as _scale_leverage reads them
+  inline uint32_t scale_leverage(uint64_t leverage) {
+    uint32_t leverage_precision = LEVERAGE_UNIT;
+    return leverage < leverage_precision/100 ? leverage * leverage_precision : leverage;
+  }
+
+  class follower {
+  public:
+    follower() : _published(std::make_shared<const state>()) {}
+
+    follower(const follower&) = delete;
+    follower& operator=(const follower&) = delete;
+
+    // false for a malformed event, an unknown one or one for a market never added, the state is
+    // left as it was
+    bool apply(const event& e) {
+      bool ok = _apply(e);
+      if (ok) {
+        _events++;
+        _millis = std::max(_millis, e.millis);
+      } else {
+        _skipped++;
+      }
+      return ok;
+    }
+
+    // makes everything applied so far visible to readers
+    std::shared_ptr<const state> publish() {
+      auto next = std::make_shared<state>();
+      next->sequence = ++_sequence;
+      next->events = _events;
+      next->millis = _millis;
+      for (auto& itr : _markets) {
+        next->markets.emplace(itr.first, itr.second);
+      }
+      std::shared_ptr<const state> published = next;
+      std::atomic_store(&_published, published);
+      _owned_markets.clear();
+      _owned_liqdts.clear();
+      return published;
+    }
+
+    // the latest published state, safe from any thread
+    std::shared_ptr<const state> snapshot() const {
+      return std::atomic_load(&_published);
+    }
+
+    uint64_t applied() const { return _events; }
+    uint64_t skipped() const { return _skipped; }
+
+  private:
+    std::shared_ptr<const state> _published;
+    std::map<std::string, std::shared_ptr<market_state>> _markets;
+    std::set<std::string> _owned_markets;   // copied since the last publish, free to change in place
+    std::set<std::string> _owned_liqdts;
+    uint64_t _sequence = 0;
+    uint64_t _events = 0;
+    uint64_t _skipped = 0;
+    uint64_t _millis = 0;
+
+    // the writable copy of a market, nullptr when it was never added
+    market_state* _market(const std::string& lpsym) {
+      auto itr = _markets.find(lpsym);
+      if (itr == _markets.end()) return nullptr;
+      if (_owned_markets.insert(lpsym).second) {
+        itr->second = std::make_shared<market_state>(*itr->second);
+      }
+      return itr->second.get();
+    }
+
+    // maps are only ever created non-const, the const in market_state is for readers
+    liqdt_map& _liqdts(market_state* m) {
+      if (_owned_liqdts.insert(m->lpsym).second) {
+        m->liqdts = std::make_shared<liqdt_map>(*m->liqdts);
+      }
+      return const_cast<liqdt_map&>(*m->liqdts);
+    }
+
+    bool _has_market(const std::string& lpsym) const {
+      return _markets.count(lpsym) > 0;
+    }
+
+    bool _apply(const event& e) {
+      const std::vector<std::string>& a = e.args;
+
+      if (e.name == "addmarket") {
+        uint64_t lp_precision;
+        token tokens[2];
+        if (a.size() != 4 || _has_market(a[0])) return false;
+        if (!parse_uint(a[1], lp_precision) || lp_precision > 18) return false;
+        if (!parse_token(a[2], tokens[0]) || !parse_token(a[3], tokens[1])) return false;
+
+        auto m = std::make_shared<market_state>();
+        m->lpsym = a[0];
+        m->lp_precision = lp_precision;
+        m->tokens[0] = tokens[0];
+        m->tokens[1] = tokens[1];
+        _markets[a[0]] = m;
+        _owned_markets.insert(a[0]);
+        _owned_liqdts.insert(a[0]);
+        return true;
+      }
+
+      if (e.name == "upconfig") {
+        uint64_t leverage;
+        double fee_rate;
+        if (a.size() != 3 || !_has_market(a[0])) return false;
+        if (!parse_uint(a[1], leverage) || !parse_decimal(a[2], fee_rate)) return false;
+
+        // a new config drops any running ramp
+        market_state* m = _market(a[0]);
+        m->ramp_from = m->ramp_to = scale_leverage(leverage);
+        m->ramp_begined_at = m->ramp_effective_secs = 0;
+        m->fee_rate = fee_rate;
+        return true;
+      }
+
+      if (e.name == "upleverage") {
+        uint64_t from, to, begined_at, effective_secs;
+        if (a.size() != 5 || !_has_market(a[0])) return false;
+        if (!parse_uint(a[1], from) || !parse_uint(a[2], to) || !parse_uint(a[3], begined_at) || !parse_uint(a[4], effective_secs)) return false;
+
+        market_state* m = _market(a[0]);
+        m->ramp_from = scale_leverage(from);
+        m->ramp_to = scale_leverage(to);
+        m->ramp_begined_at = begined_at;
+        m->ramp_effective_secs = effective_secs;
+        return true;
+      }
+
+      if (e.name == "upfee") {
+        double lp_rate;
+        int64_t index;
+        if (a.size() != 3 || !_has_market(a[0])) return false;
+        if (!parse_decimal(a[1], lp_rate) || !parse_int(a[2], index) || index < 0 || index > 1) return false;
+
+        market_state* m = _market(a[0]);
+        m->lp_rate = lp_rate;
+        m->fee_index = index;
+        return true;
+      }
+
+      if (e.name == "upmarket") {
+        int64_t reserves[2];
+        uint8_t precisions[2];
+        std::string codes[2];
+        double prices[2];
+        uint64_t lpamount;
+        if (a.size() != 6 || !_has_market(a[0])) return false;
+        for (int i = 0; i <= 1; i++) {
+          if (!parse_asset(a[1 + i], reserves[i], precisions[i], codes[i]) || !parse_double(a[3 + i], prices[i])) return false;
+        }
+        if (!parse_uint(a[5], lpamount)) return false;
+
+        market_state* m = _market(a[0]);
+        for (int i = 0; i <= 1; i++) {
+          m->reserves[i] = reserves[i];
+          m->prices[i] = prices[i];
+        }
+        m->lpamount = lpamount;
+        return true;
+      }
+
+      if (e.name == "upliqdt") {
+        int64_t amount;
+        uint8_t precision;
+        std::string code;
+        if (a.size() != 3 || !_has_market(a[1])) return false;
+        if (!parse_asset(a[2], amount, precision, code) || code != a[1] || amount < 0) return false;
+
+        // the account's lp after the change, 0 once its row is erased
+        liqdt_map& liqdts = _liqdts(_market(a[1]));
+        if (amount == 0) {
+          liqdts.erase(a[0]);
+        } else {
+          liqdts[a[0]] = amount;
+        }
+        return true;
+      }
+
+      if (e.name == "swap") {
+        int64_t amounts[3];
+        uint8_t precision;
+        std::string codes[3];
+        if (a.size() != 5 || !_has_market(a[1])) return false;
+        for (int i = 0; i < 3; i++) {
+          if (!parse_asset(a[2 + i], amounts[i], precision, codes[i])) return false;
+        }
+
+        // reserves follow from the upmarket sent with it
+        market_state* m = _market(a[1]);
+        int in = m->side(codes[0]);
+        int fee_side = m->side(codes[2]);
+        if (in < 0 || fee_side < 0) return false;
+        m->volumes[in] += amounts[0];
+        m->fees[fee_side] += amounts[2];
+        m->swaps++;
+        return true;
+      }
+
+      if (e.name == "supply" || e.name == "demand") {
+        if (a.size() != 5 || !_has_market(a[1])) return false;
+
+        market_state* m = _market(a[1]);
+        if (e.name == "supply") {
+          m->supplies++;
+        } else {
+          m->demands++;
+        }
+        return true;
+      }
+
+      if (e.name == "batch") {
+        uint64_t count;
+        double price;
+        if (a.size() != 3 || !_has_market(a[0])) return false;
+        if (!parse_uint(a[1], count) || !parse_double(a[2], price)) return false;
+
+        market_state* m = _market(a[0]);
+        m->batches++;
+        m->clear_price = price;
+        return true;
+      }
+
+      return false;
+    }
+  };
+}
+}
@@ -0,0 +1,444 @@
+// replays swap, supply and demand history against markets loaded from an exportstate snapshot,
+// under the exported config or an alternative one, to see how a setleverage target or fee_rate
+// would have performed before it is set. every operation runs through the same curve.hpp
+// arithmetic as _swap, _supply, _withdraw and _withdraw_single. markets are independent, so they
+// are shared out to worker threads, each taking the next unreplayed market when it is done.
+//
+//   g++ -std=c++17 -O2 -ffp-contract=off -pthread -o replay tools/replay.cpp
+//   ./replay [options] <snapshot file> <history file>
+//
+//   -A <A> | -A <lpsym>=<A>          replay with leverage A (e.g. 200) for all markets or one
+//   -f <rate> | -f <lpsym>=<rate>    replay with fee_rate (e.g. 0.0004) for all markets or one
+//   -j <threads>                     worker threads, all cores by default
+//   -t                               also print every operation, grouped by market
+//
+// a history file has one operation per line, amounts in the smallest unit of their token, lines
+// starting with # are skipped:
+//
+//   <lpsym> swap <in index> <amount>
+//   <lpsym> supply <amount 0> <amount 1>
+//   <lpsym> demand <lp amount> [out index]      proportional, or single-sided with out index
+//   <lpsym> <in index> <amount>                 swap, the older form
+//
+// a line per market reports what was replayed and rejected, fees and admin fees per side,
+// slippage against the marginal price (amount weighted and worst, in bps, fees excluded), the
+// reserve imbalance (average over the replay and at the end) and the value of one lp token at
+// the 1:1 peg before and after. leverage stays at the override or the exported effective value,
+// ramps are not advanced because the history carries no time.
+
+#include "../curve.hpp"
+#include "../snapshot.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace pizzair;
+
+static constexpr double LEVERAGE_UNIT = 10000;
+
+// symbol raw keeps the precision in the low byte and the code characters above it
+static std::string symbol_code_of(uint64_t raw) {
+  std::string code;
+  for (uint64_t v = raw >> 8; v > 0; v >>= 8) {
+    code.push_back((char)(v & 0xFF));
+  }
+  return code;
+}
+
+static uint8_t precision_of(uint64_t raw) {
+  return raw & 0xFF;
+}
+
+struct replay_market {
+  double A;
+  double fee_rate;
+  double lp_rate;
+  int fee_index;
+  uint8_t precisions[2];
+  uint8_t lp_precision;
+  int64_t reserves[2];
+  int64_t lpamount;
+
+  double unit(int i) const { return pow(10, precisions[i]); }
+  double r(int i) const { return reserves[i] / unit(i); }
+
+  // |x - y| / (x + y) at the peg
+  double imbalance() const {
+    return fabs(r(0) - r(1)) / (r(0) + r(1));
+  }
+
+  double lp_value() const {
+    return lpamount > 0 ? (r(0) + r(1)) / (lpamount / pow(10, lp_precision)) : 0;
+  }
+};
+
+enum operation_kind : uint8_t {
+  SWAP,
+  SUPPLY,
+  DEMAND,
+};
+
+struct operation {
+  operation_kind kind;
+  int index;             // in index of a swap, out index of a single-sided demand, -1 otherwise
+  int64_t amounts[2];    // swap and demand use the first
+  size_t line;
+};
+
+struct replay_stats {
+  uint64_t swaps = 0, supplies = 0, demands = 0, rejected = 0;
+  int64_t volumes[2] = {0, 0};
+  int64_t fees[2] = {0, 0};
+  int64_t admin_fees[2] = {0, 0};
+  double slippage_sum = 0, slippage_weight = 0, slippage_max = 0;
+  double imbalance_sum = 0;
+  uint64_t imbalance_samples = 0;
+};
+
+struct market_run {
+  std::string lpsym;
+  replay_market m;
+  std::vector<operation> operations;
+  double start_lp_value = 0;
+  replay_stats stats;
+  std::string log;
+};
+
+// the quote of _swap applied to the reserves, false when the contract would reject it
+static bool replay_swap(replay_market& m, int in, int64_t amount, replay_stats& s, std::string* log, const std::string& lpsym) {
+  int out = 1 - in;
+  double x = m.r(in), y = m.r(out);
+  bool fee_on_in = m.fee_index == in;
+
+  swap_quote quote = quote_swap(amount, m.A, x, y, m.precisions[in], m.precisions[out], m.fee_rate, m.lp_rate, fee_on_in);
+  int64_t incr = fee_on_in ? amount - quote.admin_fee : amount;
+  int64_t decr = fee_on_in ? quote.got : quote.got + quote.admin_fee;
+  if (quote.got <= 0 || decr >= m.reserves[out] || (m.fee_rate > 0 && quote.admin_fee <= 0)) return false;
+
+  // slippage of the curve alone: what the net input got against the marginal price before it
+  double net_in = (fee_on_in ? amount - quote.fee : amount) / m.unit(in);
+  double curve_out = (fee_on_in ? quote.got : quote.got + quote.fee) / m.unit(out);
+  double slippage = 1 - curve_out / (net_in * marginal_price(m.A, x, y));
+  s.slippage_sum += slippage * net_in;
+  s.slippage_weight += net_in;
+  s.slippage_max = std::max(s.slippage_max, slippage);
+
+  m.reserves[in] += incr;
+  m.reserves[out] -= decr;
+
+  int fee_side = fee_on_in ? in : out;
+  s.volumes[in] += amount;
+  s.fees[fee_side] += quote.fee;
+  s.admin_fees[fee_side] += quote.admin_fee;
+  s.swaps++;
+
+  if (log) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s swap %d %lld got %lld fee %lld reserves %lld %lld\n", lpsym.c_str(), in, (long long)amount,
+             (long long)quote.got, (long long)quote.fee, (long long)m.reserves[0], (long long)m.reserves[1]);
+    log->append(buf);
+  }
+  return true;
+}
+
+static bool replay_supply(replay_market& m, const int64_t amounts[2], replay_stats& s, std::string* log, const std::string& lpsym) {
+  if (amounts[0] < 0 || amounts[1] < 0 || (amounts[0] == 0 && amounts[1] == 0)) return false;
+  if (m.lpamount == 0 && (amounts[0] == 0 || amounts[1] == 0)) return false;
+
+  supply_quote quote = quote_supply(amounts, m.reserves, m.precisions, m.lpamount, m.lp_precision, m.A);
+  if (quote.error != SUPPLY_OK || quote.lpamount <= 0) return false;
+
+  int64_t deposits[2] = {amounts[0], amounts[1]};
+  if (quote.dropped > 0) deposits[quote.extra_index] -= quote.dropped;
+  m.reserves[0] += deposits[0];
+  m.reserves[1] += deposits[1];
+  m.lpamount += quote.lpamount;
+  s.supplies++;
+
+  if (log) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s supply %lld %lld lp %lld reserves %lld %lld\n", lpsym.c_str(), (long long)deposits[0],
+             (long long)deposits[1], (long long)quote.lpamount, (long long)m.reserves[0], (long long)m.reserves[1]);
+    log->append(buf);
+  }
+  return true;
+}
+
+// _withdraw, or _withdraw_single when out is 0 or 1
+static bool replay_demand(replay_market& m, int64_t quantity, int out, replay_stats& s, std::string* log, const std::string& lpsym) {
+  if (quantity <= 0 || quantity > m.lpamount) return false;
+
+  int64_t shares[2];
+  for (int i = 0; i <= 1; i++) {
+    shares[i] = withdraw_share(m.reserves[i], quantity, m.lpamount);
+  }
+
+  int64_t decrs[2] = {shares[0], shares[1]};
+  if (out >= 0) {
+    int in = 1 - out;
+    if (quantity == m.lpamount) return false;
+    decrs[in] = 0;
+    if (shares[in] > 0) {
+      double x = (m.reserves[in] - shares[in]) / m.unit(in);
+      double y = (m.reserves[out] - shares[out]) / m.unit(out);
+      swap_quote quote = quote_swap(shares[in], m.A, x, y, m.precisions[in], m.precisions[out], m.fee_rate, m.lp_rate, m.fee_index == in);
+      if (m.fee_rate > 0 && quote.admin_fee <= 0) return false;
+      decrs[out] += quote.got;
+      decrs[m.fee_index] += quote.admin_fee;
+      s.fees[m.fee_index] += quote.fee;
+      s.admin_fees[m.fee_index] += quote.admin_fee;
+      s.volumes[in] += shares[in];
+    }
+    if (decrs[0] >= m.reserves[0] || decrs[1] >= m.reserves[1]) return false;
+  }
+
+  m.reserves[0] -= decrs[0];
+  m.reserves[1] -= decrs[1];
+  m.lpamount -= quantity;
+  s.demands++;
+
+  if (log) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s demand %lld out %d got %lld %lld reserves %lld %lld\n", lpsym.c_str(), (long long)quantity, out,
+             (long long)decrs[0], (long long)decrs[1], (long long)m.reserves[0], (long long)m.reserves[1]);
+    log->append(buf);
+  }
+  return true;
+}
+
+static void replay_market_run(market_run& run, bool trace) {
+  replay_market& m = run.m;
+  replay_stats& s = run.stats;
+  std::string* log = trace ? &run.log : nullptr;
+  run.start_lp_value = m.lp_value();
+
+  for (const operation& op : run.operations) {
+    bool ok = false;
+    if (op.kind == SWAP) {
+      ok = replay_swap(m, op.index, op.amounts[0], s, log, run.lpsym);
+    } else if (op.kind == SUPPLY) {
+      ok = replay_supply(m, op.amounts, s, log, run.lpsym);
+    } else {
+      ok = replay_demand(m, op.amounts[0], op.index, s, log, run.lpsym);
+    }
+    if (!ok) {
+      s.rejected++;
+      if (log) log->append(run.lpsym + " rejected line " + std::to_string(op.line) + "\n");
+    }
+    if (m.reserves[0] > 0 && m.reserves[1] > 0) {
+      s.imbalance_sum += m.imbalance();
+      s.imbalance_samples++;
+    }
+  }
+}
+
+// `<lpsym>=<value>` sets one market, a bare value all of them
+static bool parse_override(const char* arg, std::map<std::string, double>& per_market, double& global) {
+  const char* eq = strchr(arg, '=');
+  char* end;
+  double value = strtod(eq ? eq + 1 : arg, &end);
+  if (*end != '\0' || end == (eq ? eq + 1 : arg)) return false;
+  if (eq) {
+    per_market[std::string(arg, eq - arg)] = value;
+  } else {
+    global = value;
+  }
+  return true;
+}
+
+static bool parse_operation(const std::string& line, std::string& lpsym, operation& op) {
+  char sym[16], kind[16];
+  long long a = 0, b = 0;
+  int n = sscanf(line.c_str(), "%15s %15s %lld %lld", sym, kind, &a, &b);
+  if (n < 3) return false;
+  lpsym = sym;
+  op.amounts[0] = op.amounts[1] = 0;
+  op.index = -1;
+
+  if (strcmp(kind, "swap") == 0) {
+    if (n != 4 || (a != 0 && a != 1) || b <= 0) return false;
+    op.kind = SWAP;
+    op.index = a;
+    op.amounts[0] = b;
+  } else if (strcmp(kind, "supply") == 0) {
+    if (n != 4) return false;
+    op.kind = SUPPLY;
+    op.amounts[0] = a;
+    op.amounts[1] = b;
+  } else if (strcmp(kind, "demand") == 0) {
+    if (n == 4 && b != 0 && b != 1) return false;
+    op.kind = DEMAND;
+    op.amounts[0] = a;
+    op.index = n == 4 ? b : -1;
+  } else if ((strcmp(kind, "0") == 0 || strcmp(kind, "1") == 0) && n == 3 && a > 0) {
+    op.kind = SWAP;
+    op.index = kind[0] - '0';
+    op.amounts[0] = a;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [-A [lpsym=]A] [-f [lpsym=]fee_rate] [-j threads] [-t] <snapshot file> <history file>\n", name);
+}
+
+int main(int argc, char** argv) {
+  std::map<std::string, double> leverages, fee_rates;
+  double leverage = 0, fee_rate = -1;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  bool trace = false;
+
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; arg++) {
+    const char* flag = argv[arg];
+    if (strcmp(flag, "-t") == 0) {
+      trace = true;
+      continue;
+    }
+    if (arg + 1 >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    const char* value = argv[++arg];
+    bool ok = true;
+    if (strcmp(flag, "-A") == 0) {
+      ok = parse_override(value, leverages, leverage);
+    } else if (strcmp(flag, "-f") == 0) {
+      ok = parse_override(value, fee_rates, fee_rate);
+    } else if (strcmp(flag, "-j") == 0) {
+      threads = std::max(1, atoi(value));
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (argc - arg != 2) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  std::vector<market_run> runs;
+  std::map<std::string, size_t> by_lpsym;
+  try {
+    snapshot::mapped_file file(argv[arg]);
+    for (const snapshot::market_record& r : file.markets()) {
+      market_run run;
+      run.lpsym = symbol_code_of(r.lptoken);
+      replay_market& m = run.m;
+      m.A = r.leverage / LEVERAGE_UNIT;
+      m.fee_rate = r.fee_rate;
+      m.lp_rate = r.lp_rate;
+      m.fee_index = r.fee_index;
+      m.lp_precision = precision_of(r.lptoken);
+      m.lpamount = r.lpamount;
+      for (int i = 0; i <= 1; i++) {
+        m.precisions[i] = precision_of(r.syms[i]);
+        m.reserves[i] = r.reserves[i];
+      }
+
+      auto litr = leverages.find(run.lpsym);
+      if (litr != leverages.end()) {
+        m.A = litr->second;
+      } else if (leverage > 0) {
+        m.A = leverage;
+      }
+      auto fitr = fee_rates.find(run.lpsym);
+      if (fitr != fee_rates.end()) {
+        m.fee_rate = fitr->second;
+      } else if (fee_rate >= 0) {
+        m.fee_rate = fee_rate;
+      }
+
+      by_lpsym[run.lpsym] = runs.size();
+      runs.push_back(std::move(run));
+    }
+  } catch (const std::exception& e) {
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  std::ifstream history(argv[arg + 1]);
+  if (!history) {
+    fprintf(stderr, "cannot open %s\n", argv[arg + 1]);
+    return 1;
+  }
+
+  uint64_t skipped = 0;
+  size_t line_number = 0;
+  std::string line, lpsym;
+  while (std::getline(history, line)) {
+    line_number++;
+    if (line.empty() || line[0] == '#') continue;
+
+    operation op;
+    if (!parse_operation(line, lpsym, op)) {
+      fprintf(stderr, "skipped malformed line %zu: %s\n", line_number, line.c_str());
+      skipped++;
+      continue;
+    }
+    auto itr = by_lpsym.find(lpsym);
+    if (itr == by_lpsym.end()) {
+      fprintf(stderr, "skipped line %zu, unknown market %s\n", line_number, lpsym.c_str());
+      skipped++;
+      continue;
+    }
+    op.line = line_number;
+    runs[itr->second].operations.push_back(op);
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < std::min<size_t>(threads, runs.size()); t++) {
+    workers.emplace_back([&]() {
+      for (size_t k = next++; k < runs.size(); k = next++) {
+        replay_market_run(runs[k], trace);
+      }
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+  uint64_t replayed = 0, rejected = 0;
+  for (const market_run& run : runs) {
+    if (run.operations.empty()) continue;
+    if (trace) fputs(run.log.c_str(), stdout);
+
+    const replay_market& m = run.m;
+    const replay_stats& s = run.stats;
+    double slippage_bps = s.slippage_weight > 0 ? s.slippage_sum / s.slippage_weight * 10000 : 0;
+    double imbalance = s.imbalance_samples > 0 ? s.imbalance_sum / s.imbalance_samples * 100 : 0;
+    double end_imbalance = m.reserves[0] > 0 && m.reserves[1] > 0 ? m.imbalance() * 100 : 0;
+    double growth = run.start_lp_value > 0 ? (m.lp_value() / run.start_lp_value - 1) * 100 : 0;
+
+    printf("%s A=%g fee_rate=%g swaps=%llu supplies=%llu demands=%llu rejected=%llu volume=%.*f/%.*f fees=%.*f/%.*f "
+           "admin_fees=%.*f/%.*f slippage_bps=%.2f/%.2f imbalance=%.2f%%/%.2f%% lp_value=%.8f->%.8f (%+.4f%%)\n",
+           run.lpsym.c_str(), m.A, m.fee_rate, (unsigned long long)s.swaps, (unsigned long long)s.supplies,
+           (unsigned long long)s.demands, (unsigned long long)s.rejected,
+           m.precisions[0], s.volumes[0] / m.unit(0), m.precisions[1], s.volumes[1] / m.unit(1),
+           m.precisions[0], s.fees[0] / m.unit(0), m.precisions[1], s.fees[1] / m.unit(1),
+           m.precisions[0], s.admin_fees[0] / m.unit(0), m.precisions[1], s.admin_fees[1] / m.unit(1),
+           slippage_bps, s.slippage_max * 10000, imbalance, end_imbalance, run.start_lp_value, m.lp_value(), growth);
+
+    replayed += s.swaps + s.supplies + s.demands;
+    rejected += s.rejected;
+  }
+
+  fprintf(stderr, "replayed %llu, rejected %llu, skipped %llu, %zu markets on %u threads in %.3fs (%.0f ops/s)\n",
+          (unsigned long long)replayed, (unsigned long long)rejected, (unsigned long long)skipped, runs.size(),
+          (unsigned)std::min<size_t>(threads, runs.size()), secs, secs > 0 ? (replayed + rejected) / secs : 0);
+  return 0;
+}